@@ -0,0 +1,222 @@
+#include "acpi.h"
+#include "../vmm/vmm.h"
+#include "../paging/paging.h"
+#include "../consol/log.h"
+
+
+#define RSDP_SIGNATURE   "RSD PTR "
+#define EBDA_SEGMENT_PTR 0x40E            // BIOS data area word holding the EBDA segment
+#define BIOS_ROM_START   0xE0000
+#define BIOS_ROM_END     0x100000
+#define ACPI_TABLE_MAX   0x100000         // anything longer is taken as corrupt
+
+struct __attribute__((packed)) acpi_rsdp {
+    char signature[8];
+    uint8_t checksum;                     // covers the first 20 bytes
+    char oem_id[6];
+    uint8_t revision;                     // 0 = ACPI 1.0, 2 = has the XSDT fields
+    uint32_t rsdt_phys;
+    uint32_t length;
+    uint64_t xsdt_phys;
+    uint8_t ext_checksum;
+    uint8_t reserved[3];
+};
+
+struct __attribute__((packed)) madt_header {
+    struct acpi_sdt_header sdt;
+    uint32_t lapic_phys;
+    uint32_t flags;
+};
+
+struct __attribute__((packed)) madt_entry {
+    uint8_t type;
+    uint8_t length;
+};
+
+#define MADT_LAPIC           0
+#define MADT_IOAPIC          1
+#define MADT_ISO             2
+#define MADT_LAPIC_OVERRIDE  5
+
+#define MADT_LAPIC_ENABLED        0x1
+#define MADT_LAPIC_ONLINE_CAPABLE 0x2
+
+static struct acpi_sdt_header* root_table = NULL;
+static int root_is_xsdt = 0;
+
+// Two pages remapped for every header looked at, so walking the root
+// table does not leave a mapping behind per entry
+static uint8_t* header_window = NULL;
+
+
+static uint8_t acpi_checksum(const void* data, uint32_t len) {
+    const uint8_t* p = data;
+    uint8_t sum = 0;
+    while (len--) sum += *p++;
+    return sum;
+}
+
+static int acpi_sig_equal(const char* a, const char* b, uint32_t len) {
+    for (uint32_t i = 0; i < len; i++) {
+        if (a[i] != b[i]) return 0;
+    }
+    return 1;
+}
+
+// The RSDP sits on a 16-byte boundary in the first KB of the EBDA or in
+// the BIOS ROM area. Both are below 1 MB, which the boot identity map
+// covers in every directory, so they are read in place.
+static struct acpi_rsdp* acpi_scan_rsdp(uintptr_t phys, uint32_t len) {
+    uint8_t* base = (uint8_t*)phys;
+
+    for (uint32_t off = 0; off + sizeof(struct acpi_rsdp) <= len; off += 16) {
+        struct acpi_rsdp* rsdp = (struct acpi_rsdp*)(base + off);
+        if (acpi_sig_equal(rsdp->signature, RSDP_SIGNATURE, 8) && acpi_checksum(rsdp, 20) == 0) {
+            return rsdp;
+        }
+    }
+    return NULL;
+}
+
+// Header at phys through header_window. Valid until the next call.
+static struct acpi_sdt_header* acpi_peek_header(uintptr_t phys) {
+    if (!header_window) {
+        header_window = vmm_alloc_flags(2 * PAGE_SIZE, true, VMM_ALLOC_RESERVE);
+        if (!header_window) return NULL;
+    }
+
+    // Two pages, as a header can straddle a page boundary
+    paging_map_range((uintptr_t)header_window, phys & ~(PAGE_SIZE - 1), 2, PAGE_PRESENT);
+    return (struct acpi_sdt_header*)(header_window + (phys & (PAGE_SIZE - 1)));
+}
+
+// Read the length through the header window, then map the whole table.
+// Tables stay mapped; there are only a handful and they are read again
+// later.
+static struct acpi_sdt_header* acpi_map_table(uintptr_t phys) {
+    struct acpi_sdt_header* hdr = acpi_peek_header(phys);
+    if (!hdr) return NULL;
+
+    uint32_t length = hdr->length;
+    if (length < sizeof(*hdr) || length > ACPI_TABLE_MAX) return NULL;
+
+    hdr = vmm_map_phys(phys, length, 0);
+    if (!hdr) return NULL;
+
+    if (acpi_checksum(hdr, length) != 0) {
+        KLOG_WARN(KERNEL, "[acpi] bad checksum on table at %x\n", (uint32_t)phys);
+        vmm_unmap_phys(hdr, phys, length);
+        return NULL;
+    }
+    return hdr;
+}
+
+
+int acpi_init(void) {
+    uintptr_t ebda = (uintptr_t)*(volatile uint16_t*)EBDA_SEGMENT_PTR << 4;
+
+    struct acpi_rsdp* rsdp = NULL;
+    if (ebda) rsdp = acpi_scan_rsdp(ebda, 1024);
+    if (!rsdp) rsdp = acpi_scan_rsdp(BIOS_ROM_START, BIOS_ROM_END - BIOS_ROM_START);
+    if (!rsdp) {
+        KLOG_WARN(KERNEL, "[acpi] no RSDP found\n");
+        return 0;
+    }
+
+    // The XSDT is preferred when present and reachable without PAE
+    if (rsdp->revision >= 2 && rsdp->xsdt_phys && !(rsdp->xsdt_phys >> 32) &&
+        acpi_checksum(rsdp, sizeof(*rsdp)) == 0) {
+        root_table = acpi_map_table((uintptr_t)rsdp->xsdt_phys);
+        root_is_xsdt = root_table != NULL;
+    }
+    if (!root_table) root_table = acpi_map_table(rsdp->rsdt_phys);
+    if (!root_table) {
+        KLOG_WARN(KERNEL, "[acpi] root table unusable\n");
+        return 0;
+    }
+
+    KLOG_INFO(KERNEL, "[acpi] %s at %x\n", root_is_xsdt ? "XSDT" : "RSDT", (uint32_t)root_table);
+    return 1;
+}
+
+struct acpi_sdt_header* acpi_find_table(const char* signature) {
+    if (!root_table) return NULL;
+
+    uint32_t entry_size = root_is_xsdt ? 8 : 4;
+    uint32_t count = (root_table->length - sizeof(struct acpi_sdt_header)) / entry_size;
+    uint8_t* entries = (uint8_t*)(root_table + 1);
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t phys = root_is_xsdt ? *(uint64_t*)(entries + i * 8) : *(uint32_t*)(entries + i * 4);
+        if (!phys || (phys >> 32)) continue;
+
+        // Check the signature through the header window first, so only
+        // the wanted table is mapped in full
+        struct acpi_sdt_header* hdr = acpi_peek_header((uintptr_t)phys);
+        if (!hdr || !acpi_sig_equal(hdr->signature, signature, 4)) continue;
+
+        return acpi_map_table((uintptr_t)phys);
+    }
+    return NULL;
+}
+
+int acpi_parse_madt(struct acpi_madt_info* info) {
+    struct madt_header* madt = (struct madt_header*)acpi_find_table("APIC");
+    if (!madt) return 0;
+
+    info->lapic_phys = madt->lapic_phys;
+    info->flags = madt->flags;
+    info->cpu_count = 0;
+    info->ioapic_count = 0;
+    for (uint32_t irq = 0; irq < ACPI_ISA_IRQS; irq++) {
+        info->isa_gsi[irq] = irq;
+        info->isa_flags[irq] = 0;
+    }
+
+    uint8_t* p = (uint8_t*)(madt + 1);
+    uint8_t* end = (uint8_t*)madt + madt->sdt.length;
+    while (p + sizeof(struct madt_entry) <= end) {
+        struct madt_entry* e = (struct madt_entry*)p;
+        if (e->length < sizeof(struct madt_entry) || p + e->length > end) break;
+
+        switch (e->type) {
+        case MADT_LAPIC: {
+            uint8_t apic_id = p[3];
+            uint32_t flags = *(uint32_t*)(p + 4);
+            if ((flags & (MADT_LAPIC_ENABLED | MADT_LAPIC_ONLINE_CAPABLE)) &&
+                info->cpu_count < ACPI_MAX_CPUS) {
+                info->cpu_apic_ids[info->cpu_count++] = apic_id;
+            }
+            break;
+        }
+        case MADT_IOAPIC:
+            if (info->ioapic_count < ACPI_MAX_IOAPICS) {
+                struct acpi_ioapic* io = &info->ioapics[info->ioapic_count++];
+                io->id = p[2];
+                io->phys = *(uint32_t*)(p + 4);
+                io->gsi_base = *(uint32_t*)(p + 8);
+            }
+            break;
+        case MADT_ISO: {
+            uint8_t source = p[3];
+            if (source < ACPI_ISA_IRQS) {
+                info->isa_gsi[source] = *(uint32_t*)(p + 4);
+                info->isa_flags[source] = *(uint16_t*)(p + 8);
+            }
+            break;
+        }
+        case MADT_LAPIC_OVERRIDE: {
+            uint64_t phys = *(uint64_t*)(p + 4);
+            if (!(phys >> 32)) info->lapic_phys = (uint32_t)phys;
+            break;
+        }
+        default:
+            break;
+        }
+        p += e->length;
+    }
+
+    KLOG_INFO(KERNEL, "[acpi] MADT: %u cpus, %u ioapics, lapic %x\n",
+              info->cpu_count, info->ioapic_count, info->lapic_phys);
+    return 1;
+}
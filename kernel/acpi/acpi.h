@@ -0,0 +1,55 @@
+#ifndef ACPI_H
+#define ACPI_H
+
+#include "../stdint.h"
+
+#define ACPI_MAX_CPUS     16
+#define ACPI_MAX_IOAPICS  4
+#define ACPI_ISA_IRQS     16
+
+struct __attribute__((packed)) acpi_sdt_header {
+    char signature[4];
+    uint32_t length;                      // whole table, header included
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+};
+
+struct acpi_ioapic {
+    uint8_t id;
+    uint32_t phys;
+    uint32_t gsi_base;                    // first global system interrupt it serves
+};
+
+// What the MADT says about the interrupt controllers. isa_gsi and
+// isa_flags start out as the identity mapping, edge triggered, active
+// high, and interrupt source overrides change individual IRQs.
+struct acpi_madt_info {
+    uint32_t lapic_phys;
+    uint32_t flags;                       // MADT_PCAT_COMPAT: 8259s are present
+    uint32_t cpu_count;
+    uint8_t cpu_apic_ids[ACPI_MAX_CPUS];
+    uint32_t ioapic_count;
+    struct acpi_ioapic ioapics[ACPI_MAX_IOAPICS];
+    uint32_t isa_gsi[ACPI_ISA_IRQS];
+    uint16_t isa_flags[ACPI_ISA_IRQS];    // MPS INTI flags, MADT_POLARITY_* | MADT_TRIGGER_*
+};
+
+#define MADT_PCAT_COMPAT      0x1
+#define MADT_POLARITY_MASK    0x3
+#define MADT_POLARITY_LOW     0x3
+#define MADT_TRIGGER_MASK     0xC
+#define MADT_TRIGGER_LEVEL    0xC
+
+// Find the RSDP and root table. Returns 0 when the firmware has no ACPI.
+int acpi_init(void);
+// Mapped table with the given signature, NULL if absent or corrupt
+struct acpi_sdt_header* acpi_find_table(const char* signature);
+// Fill info from the MADT ("APIC"). Returns 0 when there is none.
+int acpi_parse_madt(struct acpi_madt_info* info);
+
+#endif
@@ -1,5 +1,6 @@
 #include "../consol/serial.h"
 #include "panic.h"
+#include "../trace/trace.h"
 
 typedef struct {
     uint32_t eax, ebx, ecx, edx;
@@ -9,6 +10,9 @@ typedef struct {
 
 
 void panic(const char* message) {
+    // Nothing will service the TX interrupt from here on: flush what is
+    // queued and write the rest synchronously
+    serial_enter_sync();
     write_serial_string("[KERNEL PANIC] ");
     write_serial_string(message);
     write_serial('\n');
@@ -36,6 +40,9 @@ void panic(const char* message) {
     dump_cpu_registers();
     panic_print_backtrace();
      print_stack(esp, 32);
+
+    // Last events before the panic, for tools/tracedec
+    trace_drain(0);
     
 
     // Halt CPU
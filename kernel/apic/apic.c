@@ -0,0 +1,295 @@
+#include "apic.h"
+#include "../acpi/acpi.h"
+#include "../io/io.h"
+#include "../pic/pic.h"
+#include "../vmm/vmm.h"
+#include "../handlers/handler_init.h"
+#include "../consol/log.h"
+
+
+#define IA32_APIC_BASE_MSR   0x1B
+#define APIC_BASE_ENABLE     0x800
+
+// Local APIC registers, byte offsets from its base
+#define LAPIC_ID             0x020
+#define LAPIC_TPR            0x080
+#define LAPIC_EOI            0x0B0
+#define LAPIC_SVR            0x0F0
+#define LAPIC_LVT_TIMER      0x320
+#define LAPIC_LVT_ERROR      0x370
+#define LAPIC_TIMER_INIT     0x380
+#define LAPIC_TIMER_CUR      0x390
+#define LAPIC_TIMER_DIV      0x3E0
+
+#define LAPIC_SVR_ENABLE     0x100
+#define LAPIC_LVT_MASKED     0x10000
+#define LAPIC_TIMER_PERIODIC 0x20000
+#define LAPIC_TIMER_DIV_16   0x3
+
+// I/O APIC: an index register and a data window
+#define IOAPIC_REGSEL        0x00
+#define IOAPIC_WIN           0x10
+#define IOAPIC_VER           0x01
+#define IOAPIC_REDTBL(n)     (0x10 + 2 * (n))
+
+#define REDIR_POLARITY_LOW   0x2000
+#define REDIR_LEVEL          0x8000
+#define REDIR_MASKED         0x10000
+
+// PIT channel 2, gated through port 0x61, for timer calibration
+#define PIT_FREQUENCY        1193182
+#define PIT_CH2_DATA         0x42
+#define PIT_COMMAND          0x43
+#define PIT_CH2_GATE_PORT    0x61
+#define PIT_CH2_GATE         0x01
+#define PIT_CH2_SPEAKER      0x02
+#define PIT_CH2_OUT          0x20
+
+struct ioapic {
+    volatile uint32_t* base;
+    uint32_t gsi_base;
+    uint32_t entries;
+};
+
+static volatile uint32_t* lapic = NULL;
+static struct ioapic ioapics[ACPI_MAX_IOAPICS];
+static uint32_t ioapic_count = 0;
+static struct acpi_madt_info madt;
+static int apic_enabled = 0;
+static struct apic_stats stats;
+uint8_t apic_cpu_id = 0;
+
+
+static inline uint32_t lapic_read(uint32_t reg) {
+    return lapic[reg / 4];
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t value) {
+    lapic[reg / 4] = value;
+}
+
+static uint32_t ioapic_read(struct ioapic* io, uint32_t reg) {
+    io->base[IOAPIC_REGSEL / 4] = reg;
+    return io->base[IOAPIC_WIN / 4];
+}
+
+static void ioapic_write(struct ioapic* io, uint32_t reg, uint32_t value) {
+    io->base[IOAPIC_REGSEL / 4] = reg;
+    io->base[IOAPIC_WIN / 4] = value;
+}
+
+static struct ioapic* ioapic_for_gsi(uint32_t gsi) {
+    for (uint32_t i = 0; i < ioapic_count; i++) {
+        if (gsi >= ioapics[i].gsi_base && gsi < ioapics[i].gsi_base + ioapics[i].entries) {
+            return &ioapics[i];
+        }
+    }
+    return NULL;
+}
+
+// Read-modify-write of one redirection entry's low word. The select and
+// window accesses must not be split by a handler doing the same.
+static int ioapic_update(uint32_t gsi, uint32_t clear, uint32_t set) {
+    struct ioapic* io = ioapic_for_gsi(gsi);
+    if (!io) return 0;
+
+    uint32_t reg = IOAPIC_REDTBL(gsi - io->gsi_base);
+    uint32_t flags = irq_save();
+    ioapic_write(io, reg, (ioapic_read(io, reg) & ~clear) | set);
+    irq_restore(flags);
+    return 1;
+}
+
+static void ioapic_route(uint32_t gsi, uint8_t vector, uint16_t isa_flags, uint8_t dest) {
+    struct ioapic* io = ioapic_for_gsi(gsi);
+    if (!io) {
+        KLOG_WARN(KERNEL, "[apic] no I/O APIC serves GSI %u\n", gsi);
+        return;
+    }
+
+    // Starts masked; irq_unmask opens it once a driver is ready
+    uint32_t low = vector | REDIR_MASKED;
+    if ((isa_flags & MADT_POLARITY_MASK) == MADT_POLARITY_LOW) low |= REDIR_POLARITY_LOW;
+    if ((isa_flags & MADT_TRIGGER_MASK) == MADT_TRIGGER_LEVEL) low |= REDIR_LEVEL;
+
+    uint32_t reg = IOAPIC_REDTBL(gsi - io->gsi_base);
+    uint32_t flags = irq_save();
+    ioapic_write(io, reg + 1, (uint32_t)dest << 24);
+    ioapic_write(io, reg, low);
+    irq_restore(flags);
+}
+
+static int cpu_has_apic(void) {
+    uint32_t eax = 1, ebx, ecx, edx;
+    __asm__ volatile("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    return (edx >> 9) & 1;
+}
+
+static void lapic_timer_handler(struct interrupt_frame* frame) {
+    (void)frame;
+    stats.timer_ticks++;
+}
+
+// Spurious interrupts are not in service, so they get no EOI
+static void lapic_spurious_handler(struct interrupt_frame* frame) {
+    (void)frame;
+    stats.spurious++;
+}
+
+
+int apic_init(void) {
+    if (!cpu_has_apic()) {
+        KLOG_WARN(KERNEL, "[apic] no local APIC, staying on the 8259\n");
+        return 0;
+    }
+    if (!acpi_init() || !acpi_parse_madt(&madt) || !madt.ioapic_count) {
+        KLOG_WARN(KERNEL, "[apic] no usable MADT, staying on the 8259\n");
+        return 0;
+    }
+
+    lapic = vmm_map_phys(madt.lapic_phys, PAGE_SIZE, PAGE_NOCACHE);
+    if (!lapic) return 0;
+
+    for (uint32_t i = 0; i < madt.ioapic_count; i++) {
+        struct ioapic* io = &ioapics[ioapic_count];
+        io->base = vmm_map_phys(madt.ioapics[i].phys, PAGE_SIZE, PAGE_NOCACHE);
+        if (!io->base) continue;
+        io->gsi_base = madt.ioapics[i].gsi_base;
+        io->entries = ((ioapic_read(io, IOAPIC_VER) >> 16) & 0xFF) + 1;
+
+        for (uint32_t n = 0; n < io->entries; n++) {
+            ioapic_write(io, IOAPIC_REDTBL(n), REDIR_MASKED);
+        }
+        ioapic_count++;
+    }
+    if (!ioapic_count) {
+        lapic = NULL;
+        return 0;
+    }
+
+    pic_disable();
+
+    uint64_t base = rdmsr(IA32_APIC_BASE_MSR);
+    wrmsr(IA32_APIC_BASE_MSR, base | APIC_BASE_ENABLE);
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_LVT_ERROR, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+
+    // Legacy IRQs keep the vectors they had on the 8259. IRQ2 is the
+    // cascade and never carries a device.
+    uint8_t bsp = lapic_id();
+    apic_cpu_id = bsp;
+    for (uint32_t irq = 0; irq < ACPI_ISA_IRQS; irq++) {
+        if (irq == 2) continue;
+        ioapic_route(madt.isa_gsi[irq], IRQ_BASE + irq, madt.isa_flags[irq], bsp);
+    }
+
+    register_interrupt_handler(LAPIC_SPURIOUS_VECTOR, lapic_spurious_handler);
+    register_interrupt_handler(LAPIC_TIMER_VECTOR, lapic_timer_handler);
+
+    stats.cpu_count = madt.cpu_count;
+    stats.ioapic_count = ioapic_count;
+    apic_enabled = 1;
+    stats.active = 1;
+
+    lapic_timer_start(LAPIC_TIMER_HZ);
+
+    KLOG_INFO(KERNEL, "[apic] lapic %u, %u I/O APICs, timer %u ticks/ms\n",
+              bsp, ioapic_count, stats.timer_ticks_per_ms);
+    return 1;
+}
+
+int apic_active(void) {
+    return apic_enabled;
+}
+
+// 0 until the local APIC is mapped, which matches the only CPU running then
+uint8_t lapic_id(void) {
+    if (!lapic) return 0;
+    return lapic_read(LAPIC_ID) >> 24;
+}
+
+void lapic_eoi(void) {
+    lapic_write(LAPIC_EOI, 0);
+}
+
+// Count LAPIC timer ticks across a LAPIC_CALIBRATE_MS one-shot on PIT
+// channel 2, which can be polled without an interrupt
+static uint32_t lapic_timer_calibrate(void) {
+    uint32_t pit_count = PIT_FREQUENCY / 1000 * LAPIC_CALIBRATE_MS;
+
+    uint8_t gate = inb(PIT_CH2_GATE_PORT) & ~(PIT_CH2_SPEAKER | PIT_CH2_GATE);
+    outb(PIT_CH2_GATE_PORT, gate);
+    outb(PIT_COMMAND, 0xB0);              // channel 2, lo/hi byte, mode 0
+    outb(PIT_CH2_DATA, pit_count & 0xFF);
+    outb(PIT_CH2_DATA, pit_count >> 8);
+
+    lapic_write(LAPIC_TIMER_DIV, LAPIC_TIMER_DIV_16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+
+    // Raising the gate starts the PIT count; OUT goes high when it expires
+    outb(PIT_CH2_GATE_PORT, gate | PIT_CH2_GATE);
+    lapic_write(LAPIC_TIMER_INIT, 0xFFFFFFFF);
+    while (!(inb(PIT_CH2_GATE_PORT) & PIT_CH2_OUT));
+    uint32_t elapsed = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CUR);
+
+    lapic_write(LAPIC_TIMER_INIT, 0);
+    outb(PIT_CH2_GATE_PORT, gate);
+    return elapsed / LAPIC_CALIBRATE_MS;
+}
+
+void lapic_timer_start(uint32_t hz) {
+    if (!apic_enabled || !hz) return;
+
+    if (!stats.timer_ticks_per_ms) stats.timer_ticks_per_ms = lapic_timer_calibrate();
+
+    uint32_t initial = stats.timer_ticks_per_ms * 1000 / hz;
+    if (!initial) initial = 1;
+
+    lapic_write(LAPIC_TIMER_DIV, LAPIC_TIMER_DIV_16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_VECTOR | LAPIC_TIMER_PERIODIC);
+    lapic_write(LAPIC_TIMER_INIT, initial);
+}
+
+
+void irq_eoi(uint8_t irq) {
+    if (apic_enabled) {
+        lapic_eoi();
+    } else {
+        pic_send_eoi(irq);
+    }
+}
+
+void irq_mask(uint8_t irq) {
+    if (!apic_enabled) {
+        pic_mask(irq);
+        return;
+    }
+    if (irq < ACPI_ISA_IRQS) ioapic_update(madt.isa_gsi[irq], 0, REDIR_MASKED);
+}
+
+void irq_unmask(uint8_t irq) {
+    if (!apic_enabled) {
+        pic_unmask(irq);
+        return;
+    }
+    if (irq < ACPI_ISA_IRQS) ioapic_update(madt.isa_gsi[irq], REDIR_MASKED, 0);
+}
+
+int irq_set_affinity(uint8_t irq, uint8_t apic_id) {
+    if (!apic_enabled || irq >= ACPI_ISA_IRQS) return 0;
+
+    struct ioapic* io = ioapic_for_gsi(madt.isa_gsi[irq]);
+    if (!io) return 0;
+
+    uint32_t reg = IOAPIC_REDTBL(madt.isa_gsi[irq] - io->gsi_base);
+    uint32_t flags = irq_save();
+    ioapic_write(io, reg + 1, (uint32_t)apic_id << 24);
+    irq_restore(flags);
+    return 1;
+}
+
+void apic_get_stats(struct apic_stats* out) {
+    *out = stats;
+}
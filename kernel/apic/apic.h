@@ -0,0 +1,47 @@
+#ifndef APIC_H
+#define APIC_H
+
+#include "../stdint.h"
+#include "../handlers/handler_init.h"
+
+#define LAPIC_TIMER_VECTOR    LOCAL_IRQ_BASE
+#define LAPIC_SPURIOUS_VECTOR 0xFF
+#define LAPIC_TIMER_HZ        100
+#define LAPIC_CALIBRATE_MS    10          // PIT window the timer is measured against
+
+struct apic_stats {
+    uint32_t active;                      // 1 when the LAPIC/IOAPIC path is in use
+    uint32_t cpu_count;                   // from the MADT
+    uint32_t ioapic_count;
+    uint32_t timer_ticks_per_ms;          // LAPIC timer counts at divide-by-16
+    uint32_t timer_ticks;                 // timer interrupts taken
+    uint32_t spurious;
+};
+
+// Switch from the 8259s to the local APIC and I/O APICs found in the ACPI
+// MADT: legacy IRQs keep their vectors (IRQ_BASE + irq) but are acked at
+// the local APIC. Needs the VMM. Returns 0, leaving the 8259s in charge,
+// when there is no APIC or MADT.
+int apic_init(void);
+int apic_active(void);
+// Reads the LAPIC ID register, uncached MMIO
+uint8_t lapic_id(void);
+
+// Local APIC id of the boot CPU, read once by apic_init. 0 on the 8259.
+// Hot paths read this instead of lapic_id().
+extern uint8_t apic_cpu_id;
+void lapic_eoi(void);
+
+// Periodic LAPIC timer at hz on LAPIC_TIMER_VECTOR, calibrated on the PIT
+void lapic_timer_start(uint32_t hz);
+
+// Legacy IRQ line control on whichever controller is active
+void irq_eoi(uint8_t irq);
+void irq_mask(uint8_t irq);
+void irq_unmask(uint8_t irq);
+// Deliver irq to the CPU with the given local APIC id. Returns 0 on the 8259.
+int irq_set_affinity(uint8_t irq, uint8_t apic_id);
+
+void apic_get_stats(struct apic_stats* out);
+
+#endif
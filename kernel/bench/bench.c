@@ -0,0 +1,139 @@
+#include "bench.h"
+#include "../io/io.h"
+#include "../consol/serial.h"
+#include "../consol/log.h"
+#include "../pmm/pmm.h"
+#include "../paging/paging.h"
+#include "../vmm/vmm.h"
+#include "../alarm/panic.h"
+#include "../idt/idt.h"
+#include "../handlers/handler_init.h"
+#include "../pic/pic.h"
+#include "../apic/apic.h"
+
+extern void isr_bench_iret(void);
+
+
+struct bench_result {
+    uint32_t pmm;        // pmm_alloc_page + pmm_free_page
+    uint32_t map;        // paging_map_page + paging_unmap_page
+    uint32_t vmm;        // vmm_alloc + vmm_free of one kernel page
+};
+
+static void bench_pass(uintptr_t scratch, struct bench_result* out) {
+    uint64_t start = rdtsc();
+    for (uint32_t i = 0; i < BENCH_ITERATIONS; i++) {
+        pmm_free_page(pmm_alloc_page());
+    }
+    out->pmm = (uint32_t)((rdtsc() - start) / BENCH_ITERATIONS);
+
+    start = rdtsc();
+    for (uint32_t i = 0; i < BENCH_ITERATIONS; i++) {
+        paging_map_page(scratch, pmm_alloc_page(), 0x3);
+        paging_unmap_page(scratch);
+    }
+    out->map = (uint32_t)((rdtsc() - start) / BENCH_ITERATIONS);
+
+    start = rdtsc();
+    for (uint32_t i = 0; i < BENCH_ITERATIONS; i++) {
+        void* p = vmm_alloc(PAGE_SIZE, true);
+        if (!p) panic("bench: vmm_alloc failed");
+        vmm_free(p, PAGE_SIZE, true);
+    }
+    out->vmm = (uint32_t)((rdtsc() - start) / BENCH_ITERATIONS);
+}
+
+static void bench_print(const char* label, struct bench_result* r) {
+    klog_printf("[bench] %s: pmm alloc+free %u, map+unmap %u, vmm alloc+free %u cycles\n",
+                label, r->pmm, r->map, r->vmm);
+}
+
+void bench_memory_ops(void) {
+    // A reserved but unbacked page, so mapping by hand cannot clobber anything
+    void* scratch = vmm_alloc_lazy(PAGE_SIZE, true);
+    if (!scratch) panic("bench: no scratch page");
+
+    struct bench_result quiet;
+
+#ifdef KERNEL_DEBUG
+    struct bench_result verbose;
+    uint8_t old_pmm = log_set_level(LOG_SUB_PMM, LOG_LVL_TRACE);
+    uint8_t old_paging = log_set_level(LOG_SUB_PAGING, LOG_LVL_TRACE);
+    uint8_t old_vmm = log_set_level(LOG_SUB_VMM, LOG_LVL_TRACE);
+    bench_pass((uintptr_t)scratch, &verbose);
+
+    log_set_level(LOG_SUB_PMM, LOG_LVL_WARN);
+    log_set_level(LOG_SUB_PAGING, LOG_LVL_WARN);
+    log_set_level(LOG_SUB_VMM, LOG_LVL_WARN);
+    bench_pass((uintptr_t)scratch, &quiet);
+
+    log_set_level(LOG_SUB_PMM, old_pmm);
+    log_set_level(LOG_SUB_PAGING, old_paging);
+    log_set_level(LOG_SUB_VMM, old_vmm);
+
+    bench_print("logging at trace", &verbose);
+    bench_print("logging at warn", &quiet);
+#else
+    bench_pass((uintptr_t)scratch, &quiet);
+    bench_print("release logging", &quiet);
+#endif
+
+    vmm_free(scratch, PAGE_SIZE, true);
+}
+
+
+static volatile uint32_t bench_irq_hits;
+
+static void bench_irq_handler(struct interrupt_frame* frame) {
+    (void)frame;
+    bench_irq_hits++;
+}
+
+void bench_interrupts(void) {
+    idt_set_gate(BENCH_VECTOR_BARE, (uint32_t)isr_bench_iret, 0x08, 0x8E);
+    register_interrupt_handler(BENCH_VECTOR, bench_irq_handler);
+    bench_irq_hits = 0;
+
+    // Warm both paths so the first measured pass is not a cold miss
+    __asm__ volatile("int %0" :: "i"(BENCH_VECTOR_BARE));
+    __asm__ volatile("int %0" :: "i"(BENCH_VECTOR));
+
+    uint64_t start = rdtsc();
+    for (uint32_t i = 0; i < BENCH_ITERATIONS; i++) {
+        __asm__ volatile("int %0" :: "i"(BENCH_VECTOR_BARE) : "memory");
+    }
+    uint32_t bare = (uint32_t)((rdtsc() - start) / BENCH_ITERATIONS);
+
+    start = rdtsc();
+    for (uint32_t i = 0; i < BENCH_ITERATIONS; i++) {
+        __asm__ volatile("int %0" :: "i"(BENCH_VECTOR) : "memory");
+    }
+    uint32_t full = (uint32_t)((rdtsc() - start) / BENCH_ITERATIONS);
+
+    if (bench_irq_hits != BENCH_ITERATIONS + 1) panic("bench: interrupt handler missed calls");
+
+    register_interrupt_handler(BENCH_VECTOR, 0);
+    idt_set_gate(BENCH_VECTOR_BARE, isr_stub_table[BENCH_VECTOR_BARE], 0x08, 0x8E);
+
+    klog_printf("[bench] int+iret %u, through isr_common %u, entry path %u cycles\n",
+                bare, full, full > bare ? full - bare : 0);
+
+    // EOI with nothing in service is ignored by both controllers, so this
+    // is the bare cost of the port write against the MMIO store
+    start = rdtsc();
+    for (uint32_t i = 0; i < BENCH_ITERATIONS; i++) {
+        pic_send_eoi(0);
+    }
+    uint32_t pic_eoi = (uint32_t)((rdtsc() - start) / BENCH_ITERATIONS);
+
+    if (apic_active()) {
+        start = rdtsc();
+        for (uint32_t i = 0; i < BENCH_ITERATIONS; i++) {
+            lapic_eoi();
+        }
+        uint32_t lapic = (uint32_t)((rdtsc() - start) / BENCH_ITERATIONS);
+        klog_printf("[bench] eoi: 8259 %u, local APIC %u cycles\n", pic_eoi, lapic);
+    } else {
+        klog_printf("[bench] eoi: 8259 %u cycles, no local APIC\n", pic_eoi);
+    }
+}
@@ -0,0 +1,21 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "../stdint.h"
+
+#define BENCH_ITERATIONS 64
+#define BENCH_VECTOR      0x30            // first free vector above the PIC range
+#define BENCH_VECTOR_BARE 0x31
+
+// Average TSC cycles per pmm, paging and vmm operation. Debug builds run
+// each twice, with the memory subsystems logging at trace level and then
+// at warn, to show what the serial output costs.
+void bench_memory_ops(void);
+
+// Average TSC cycles for an int/iret round trip, once through a gate that
+// is only an iret and once through the full isr_common path with an empty
+// registered handler. The difference is what the entry path costs. Also
+// compares an 8259 EOI with a local APIC one.
+void bench_interrupts(void);
+
+#endif
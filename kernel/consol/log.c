@@ -0,0 +1,85 @@
+#include "log.h"
+#include "serial.h"
+#include <stdarg.h>
+
+
+#ifdef KERNEL_DEBUG
+uint8_t log_levels[LOG_SUB_COUNT] = {
+    LOG_MAX_PMM, LOG_MAX_PAGING, LOG_MAX_VMM, LOG_MAX_SLAB, LOG_MAX_KERNEL
+};
+#endif
+
+
+uint8_t log_set_level(uint32_t sub, uint8_t level) {
+#ifdef KERNEL_DEBUG
+    if (sub >= LOG_SUB_COUNT) return 0;
+    uint8_t old = log_levels[sub];
+    log_levels[sub] = level;
+    return old;
+#else
+    (void)sub;
+    (void)level;
+    return LOG_COMPILE_LEVEL;
+#endif
+}
+
+void klog_printf(const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+
+    for (; *fmt; fmt++) {
+        if (*fmt != '%') {
+            write_serial(*fmt);
+            continue;
+        }
+
+        switch (*++fmt) {
+        case 's': {
+            const char* s = va_arg(ap, const char*);
+            write_serial_string(s ? s : "(null)");
+            break;
+        }
+        case 'c':
+            write_serial((char)va_arg(ap, int));
+            break;
+        case 'd':
+            serial_write_dec(va_arg(ap, int));
+            break;
+        case 'u': {
+            // serial_write_dec takes an int; split so values past 2^31 print right
+            uint32_t v = va_arg(ap, uint32_t);
+            if (v >= 1000000000u) {
+                serial_write_dec(v / 1000000000u);
+                uint32_t rest = v % 1000000000u;
+                for (uint32_t div = 100000000u; div; div /= 10) {
+                    write_serial('0' + (rest / div) % 10);
+                }
+            } else {
+                serial_write_dec((int)v);
+            }
+            break;
+        }
+        case 'x':
+            serial_write_hex32(va_arg(ap, uint32_t));
+            break;
+        case 'l':
+            if (fmt[1] == 'l' && fmt[2] == 'x') {
+                fmt += 2;
+                serial_write_hex64(va_arg(ap, uint64_t));
+            }
+            break;
+        case '%':
+            write_serial('%');
+            break;
+        case '\0':
+            fmt--;
+            break;
+        default:
+            write_serial('%');
+            write_serial(*fmt);
+            break;
+        }
+    }
+
+    va_end(ap);
+}
@@ -0,0 +1,76 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include "../stdint.h"
+
+// Kernel log levels, lower is more severe
+#define LOG_LVL_NONE  0
+#define LOG_LVL_ERR   1
+#define LOG_LVL_WARN  2
+#define LOG_LVL_INFO  3
+#define LOG_LVL_DEBUG 4
+#define LOG_LVL_TRACE 5
+
+// Highest level compiled in. Calls above it expand to a constant-false
+// branch, so neither the call nor its arguments survive. Set from the
+// makefile with LOG_LEVEL=n.
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LVL_WARN
+#endif
+
+// Per-subsystem ceilings, each defaulting to LOG_COMPILE_LEVEL. Override
+// one with e.g. -DLOG_MAX_PAGING=LOG_LVL_TRACE to debug just that code.
+#ifndef LOG_MAX_PMM
+#define LOG_MAX_PMM LOG_COMPILE_LEVEL
+#endif
+#ifndef LOG_MAX_PAGING
+#define LOG_MAX_PAGING LOG_COMPILE_LEVEL
+#endif
+#ifndef LOG_MAX_VMM
+#define LOG_MAX_VMM LOG_COMPILE_LEVEL
+#endif
+#ifndef LOG_MAX_SLAB
+#define LOG_MAX_SLAB LOG_COMPILE_LEVEL
+#endif
+#ifndef LOG_MAX_KERNEL
+#define LOG_MAX_KERNEL LOG_COMPILE_LEVEL
+#endif
+
+#define LOG_SUB_PMM    0
+#define LOG_SUB_PAGING 1
+#define LOG_SUB_VMM    2
+#define LOG_SUB_SLAB   3
+#define LOG_SUB_KERNEL 4
+#define LOG_SUB_COUNT  5
+
+// Debug builds (KERNEL_DEBUG) also check a per-subsystem level that can be
+// changed at run time. Release builds only have the compile-time ceiling.
+#ifdef KERNEL_DEBUG
+extern uint8_t log_levels[LOG_SUB_COUNT];
+#define LOG_RUNTIME_ON(sub, lvl) ((lvl) <= log_levels[LOG_SUB_##sub])
+#else
+#define LOG_RUNTIME_ON(sub, lvl) 1
+#endif
+
+#define LOG_ON(sub, lvl) ((lvl) <= LOG_MAX_##sub && LOG_RUNTIME_ON(sub, lvl))
+
+#define KLOG(sub, lvl, ...)                        \
+    do {                                           \
+        if (LOG_ON(sub, lvl)) klog_printf(__VA_ARGS__); \
+    } while (0)
+
+#define KLOG_ERR(sub, ...)   KLOG(sub, LOG_LVL_ERR, __VA_ARGS__)
+#define KLOG_WARN(sub, ...)  KLOG(sub, LOG_LVL_WARN, __VA_ARGS__)
+#define KLOG_INFO(sub, ...)  KLOG(sub, LOG_LVL_INFO, __VA_ARGS__)
+#define KLOG_DEBUG(sub, ...) KLOG(sub, LOG_LVL_DEBUG, __VA_ARGS__)
+#define KLOG_TRACE(sub, ...) KLOG(sub, LOG_LVL_TRACE, __VA_ARGS__)
+
+// Small printf for the serial console: %s %c %d %u, %x as 0x + 8 digits
+// (like serial_write_hex32), %llx as 0x + 16 digits, and %%
+void klog_printf(const char* fmt, ...);
+
+// Runtime level of one subsystem. Returns the previous level; a no-op
+// returning the compile-time level in release builds.
+uint8_t log_set_level(uint32_t sub, uint8_t level);
+
+#endif
@@ -1,35 +1,168 @@
 #include "serial.h"
 #include "../io/io.h"
+#include "../apic/apic.h"
+#include "../handlers/handler_init.h"
 
 
 #define SERIAL_PORT 0x3F8
-#define SERIAL_LCR   0x03   
-#define SERIAL_FCR   0x01   
-#define SERIAL_DLL   0x00  
-#define SERIAL_DLM   0x00   
-#define SERIAL_IER   0x00 
+#define SERIAL_THR   0x00   // transmit holding (DLAB = 0)
+#define SERIAL_DLL   0x00   // divisor low (DLAB = 1)
+#define SERIAL_IER   0x01
+#define SERIAL_DLM   0x01   // divisor high (DLAB = 1)
+#define SERIAL_IIR   0x02   // read
+#define SERIAL_FCR   0x02   // write
+#define SERIAL_LCR   0x03
+#define SERIAL_MCR   0x04
 #define SERIAL_LSR   0x05
+#define SERIAL_MSR   0x06
+
+#define LCR_8N1      0x03
+#define LCR_DLAB     0x80
+#define FCR_ENABLE   0xC7   // enable, clear both FIFOs, 14-byte RX trigger
+#define MCR_OUT2     0x0B   // DTR | RTS | OUT2, OUT2 gates the IRQ line
+#define IER_THRE     0x02
+#define LSR_THRE     0x20
+#define IIR_NONE     0x01
+#define IIR_ID_MASK  0x0E
+#define IIR_THRE     0x02
+#define IIR_RX       0x04
+#define IIR_LINE     0x06
+#define IIR_TIMEOUT  0x0C
+
+static char tx_ring[SERIAL_TX_RING_SIZE];
+static volatile uint32_t tx_head = 0;       // next byte to queue
+static volatile uint32_t tx_tail = 0;       // next byte to send
+static volatile int tx_active = 0;          // THRE interrupt armed
+static int irq_mode = 0;
+static struct serial_stats stats;
+
 
 static void wait_for_transmit(){
-    while ((inb(SERIAL_PORT + SERIAL_LSR) & 0x20) == 0);
+    while ((inb(SERIAL_PORT + SERIAL_LSR) & LSR_THRE) == 0);
+}
+
+// Move up to one FIFO's worth from the ring into the UART. Called with
+// interrupts off and THR known to be empty.
+static void tx_fill_fifo(void) {
+    for (int i = 0; i < SERIAL_FIFO_SIZE && tx_tail != tx_head; i++) {
+        outb(SERIAL_PORT + SERIAL_THR, tx_ring[tx_tail & (SERIAL_TX_RING_SIZE - 1)]);
+        tx_tail++;
+    }
 }
 
 
 void init_serial() {
-    outb(SERIAL_PORT + 1, 0x00);
+    outb(SERIAL_PORT + SERIAL_IER, 0x00);
+    serial_set_baud(SERIAL_BAUD);
+    outb(SERIAL_PORT + SERIAL_FCR, FCR_ENABLE);
+    outb(SERIAL_PORT + SERIAL_MCR, MCR_OUT2);
+}
 
-    outb(SERIAL_PORT + 3, 0x80);
+// The UART clock divided by 16 is 115200, so baud picks the divisor
+void serial_set_baud(uint32_t baud) {
+    if (baud == 0 || baud > 115200) baud = 115200;
+    uint16_t divisor = 115200 / baud;
 
-    outb(SERIAL_PORT + 0, 0x0C);
+    serial_flush();
+    outb(SERIAL_PORT + SERIAL_LCR, LCR_DLAB);
+    outb(SERIAL_PORT + SERIAL_DLL, divisor & 0xFF);
+    outb(SERIAL_PORT + SERIAL_DLM, divisor >> 8);
+    outb(SERIAL_PORT + SERIAL_LCR, LCR_8N1);
+}
 
-    outb(SERIAL_PORT + 3, SERIAL_LCR);
-    
-    outb(SERIAL_PORT + 2, SERIAL_FCR);
+static void serial_irq_handler(struct interrupt_frame* frame) {
+    (void)frame;
+    uint8_t iir;
+    while (!((iir = inb(SERIAL_PORT + SERIAL_IIR)) & IIR_NONE)) {
+        switch (iir & IIR_ID_MASK) {
+        case IIR_THRE:
+            stats.irqs++;
+            if (tx_tail != tx_head) {
+                tx_fill_fifo();
+            } else {
+                outb(SERIAL_PORT + SERIAL_IER, 0x00);
+                tx_active = 0;
+            }
+            break;
+        case IIR_RX:
+        case IIR_TIMEOUT:
+            inb(SERIAL_PORT + SERIAL_THR);      // no receive path yet, drop it
+            break;
+        case IIR_LINE:
+            inb(SERIAL_PORT + SERIAL_LSR);
+            break;
+        default:
+            inb(SERIAL_PORT + SERIAL_MSR);
+            break;
+        }
+    }
 }
 
-void write_serial( char c){
+void serial_enable_irq(void) {
+    register_irq_handler(SERIAL_IRQ, serial_irq_handler);
+    irq_mode = 1;
+    irq_unmask(SERIAL_IRQ);
+}
+
+// Send ring bytes by polling. Used when the ring is full with interrupts
+// off, and when leaving interrupt mode.
+static void tx_drain_polled(void) {
+    while (tx_tail != tx_head) {
+        wait_for_transmit();
+        tx_fill_fifo();
+    }
+}
+
+void serial_enter_sync(void) {
+    uint32_t flags = irq_save();
+    irq_mode = 0;
+    outb(SERIAL_PORT + SERIAL_IER, 0x00);
+    tx_active = 0;
+    tx_drain_polled();
+    irq_restore(flags);
+}
+
+void serial_flush(void) {
+    uint32_t flags = irq_save();
+    tx_drain_polled();
+    irq_restore(flags);
     wait_for_transmit();
-    outb(SERIAL_PORT, c);
+}
+
+void serial_get_stats(struct serial_stats* out) {
+    *out = stats;
+}
+
+void write_serial( char c){
+    if (!irq_mode) {
+        wait_for_transmit();
+        outb(SERIAL_PORT + SERIAL_THR, c);
+        stats.polled++;
+        return;
+    }
+
+    uint32_t flags = irq_save();
+
+    // Ring full: with interrupts off here nothing else will empty it, so
+    // push a FIFO's worth out by hand
+    if (tx_head - tx_tail == SERIAL_TX_RING_SIZE) {
+        stats.ring_full++;
+        wait_for_transmit();
+        tx_fill_fifo();
+    }
+
+    tx_ring[tx_head & (SERIAL_TX_RING_SIZE - 1)] = c;
+    tx_head++;
+    stats.queued++;
+
+    // Arming THRE with the holding register empty raises the interrupt
+    // straight away, and the handler takes it from there
+    if (!tx_active) {
+        tx_active = 1;
+        outb(SERIAL_PORT + SERIAL_IER, IER_THRE);
+    }
+
+    irq_restore(flags);
 }
 
 void write_serial_string(const char* str){
@@ -79,4 +212,3 @@ void serial_write_hex64(uint64_t num) {
         write_serial(nibble < 10 ? '0' + nibble : 'A' + nibble - 10);
     }
 }
-
@@ -3,8 +3,30 @@
 
 #include "../stdint.h"
 
+#define SERIAL_IRQ 4                      // COM1
+#define SERIAL_BAUD 115200                // 115200 / SERIAL_BAUD must be a whole divisor
+#define SERIAL_TX_RING_SIZE 4096          // bytes, must be a power of two
+#define SERIAL_FIFO_SIZE 16               // 16550A transmit FIFO
 
+struct serial_stats {
+    uint32_t queued;             // bytes that went through the TX ring
+    uint32_t polled;             // bytes written synchronously
+    uint32_t irqs;               // THRE interrupts taken
+    uint32_t ring_full;          // writes that had to wait for ring space
+};
+
+// Starts in synchronous mode: every byte polls LSR, as early boot and
+// panic need. serial_enable_irq switches to the interrupt-driven TX ring
+// once the IDT and PIC are ready.
 void init_serial();
+void serial_set_baud(uint32_t baud);
+void serial_enable_irq(void);
+
+// Back to polling for panic: drains the ring by hand, then writes directly
+void serial_enter_sync(void);
+// Wait until everything queued has left the FIFO
+void serial_flush(void);
+void serial_get_stats(struct serial_stats* out);
 
 void write_serial(char c);
 
@@ -2,7 +2,7 @@
 #include "../alarm/panic.h"
 
 
-struct gdt_entry_t gdt_entries[6];
+struct gdt_entry_t gdt_entries[GDT_ENTRIES];
 struct gdt_ptr_t gdt_ptr;
 
 void gdt_set_gate(int num, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran) 
@@ -23,7 +23,7 @@ extern void gdt_flush(uint32_t);
 
 void gdt_install(void)
 {
- gdt_ptr.limit = (sizeof(struct gdt_entry_t) * 6) - 1;
+ gdt_ptr.limit = (sizeof(struct gdt_entry_t) * GDT_ENTRIES) - 1;
  gdt_ptr.base = (uint32_t)&gdt_entries;
 
  gdt_set_gate(0, 0, 0, 0, 0);
@@ -45,7 +45,7 @@ void gdt_install(void)
 
 void gdt_self_test(void)
 {
-    if (gdt_ptr.limit != (sizeof(struct gdt_entry_t) * 6 - 1)) {
+    if (gdt_ptr.limit != (sizeof(struct gdt_entry_t) * GDT_ENTRIES - 1)) {
         panic("GDT: Limit mismatch");
     }
 
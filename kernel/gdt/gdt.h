@@ -3,6 +3,9 @@
 
 #include "../stdint.h"
 
+// null, kernel code/data, user code/data, TSS, double-fault TSS
+#define GDT_ENTRIES 7
+
 
 
 struct __attribute__((packed)) gdt_entry_t
@@ -25,7 +28,7 @@ void gdt_set_gate(int num, uint32_t base, uint32_t limit, uint8_t access, uint8_
 void gdt_install(void);
 void gdt_self_test(void);
 
-extern struct gdt_entry_t gdt_entries[6];
+extern struct gdt_entry_t gdt_entries[GDT_ENTRIES];
 extern struct gdt_ptr_t gdt_ptr;
 
 
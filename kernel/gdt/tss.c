@@ -1,8 +1,12 @@
 #include "tss.h"
 #include "gdt.h"
 #include "../alarm/panic.h"
+#include "../idt/idt.h"
 
 struct tss_entry_t tss_entry;
+struct tss_entry_t df_tss_entry;
+
+static uint8_t df_stack[DF_STACK_SIZE] __attribute__((aligned(16)));
 
 extern void tss_flush(void);
 
@@ -50,6 +54,35 @@ void set_kernel_stack(uint32_t stack){
     tss_entry.esp0 = stack;
 }
 
+// Double faults switch to their own task and stack through a task gate.
+// A kernel stack that overflows into its guard page cannot take the #PF
+// frame either, and on the same stack that would end in a triple fault.
+void tss_install_double_fault(int gdt_index, uint32_t cr3, void (*entry)(void)){
+
+    for(uint32_t i = 0; i < sizeof(df_tss_entry); i++) {
+        ((uint8_t*)&df_tss_entry)[i] = 0;
+    }
+
+    df_tss_entry.cr3 = cr3;
+    df_tss_entry.eip = (uint32_t)entry;
+    df_tss_entry.eflags = 0x2;            // interrupts off
+    df_tss_entry.esp = (uint32_t)(df_stack + DF_STACK_SIZE);
+    df_tss_entry.esp0 = df_tss_entry.esp;
+    df_tss_entry.ss0 = 0x10;
+    df_tss_entry.cs = 0x08;
+    df_tss_entry.ss = 0x10;
+    df_tss_entry.ds = 0x10;
+    df_tss_entry.es = 0x10;
+    df_tss_entry.fs = 0x10;
+    df_tss_entry.gs = 0x10;
+    df_tss_entry.iomap_base = sizeof(df_tss_entry);
+
+    gdt_set_gate(gdt_index, (uint32_t)&df_tss_entry, sizeof(df_tss_entry) - 1, 0x89, 0x00);
+
+    // Task gate: present, DPL 0, type 5; the offset is unused
+    idt_set_gate(8, 0, gdt_index * 8, 0x85);
+}
+
 
 void tss_self_test(void)
 {
@@ -35,7 +35,13 @@ struct __attribute__((packed)) tss_entry_t
     uint16_t iomap_base;
 } __attribute__((packed));
 
+#define DF_STACK_SIZE 4096
+
+// The interrupted context is saved here when the double-fault task runs
+extern struct tss_entry_t tss_entry;
+
 void tss_install(int gdt_index, uint32_t kernel_ss, uint32_t kernel_esp);
+void tss_install_double_fault(int gdt_index, uint32_t cr3, void (*entry)(void));
 
 void set_kernel_stack(uint32_t stack);
 void tss_self_test(void);
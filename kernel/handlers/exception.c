@@ -1,54 +1,96 @@
 #include "../alarm/panic.h"
 #include "../stdint.h"
 #include "../consol/serial.h"
+#include "../vmm/vmm.h"
+#include "../gdt/tss.h"
+#include "../trace/trace.h"
+#include "handler_init.h"
 
-// Declare handlers to be called from assembly stubs
-void isr_divide_by_zero_stub_handler(int int_no, uint32_t error_code);
-void isr_double_fault_stub_handler(int int_no, uint32_t error_code);
-void isr_gpf_stub_handler(int int_no, uint32_t error_code);
-void isr_page_fault_stub_handler(int int_no, uint32_t error_code);
-void isr_generic_exception_stub_handler(int int_no, uint32_t error_code);
-void syscall();
+void double_fault_task(void);
 
 
-// Then rename your previous C handlers like this, or make wrapper functions
-void isr_divide_by_zero_stub_handler(int int_no, uint32_t error_code) {
-    
-    serial_write_dec(int_no);
-    serial_write_hex32(error_code);
+static void report_frame(struct interrupt_frame* frame) {
+    write_serial_string("vector ");
+    serial_write_dec(frame->int_no);
+    write_serial_string(" error code ");
+    serial_write_hex32(frame->err_code);
+    write_serial_string(" eip ");
+    serial_write_hex32(frame->eip);
+    write_serial_string("\n");
+}
+
+static void divide_by_zero_handler(struct interrupt_frame* frame) {
+    report_frame(frame);
     panic("Exception: Divide By Zero");
 }
-void isr_double_fault_stub_handler(int int_no, uint32_t error_code) {
-    serial_write_dec(int_no);
-    serial_write_hex32(error_code);
+
+// Only reached before tss_install_double_fault swaps vector 8 for a task gate
+static void double_fault_handler(struct interrupt_frame* frame) {
+    report_frame(frame);
     panic("Exception: Double Fault");
 }
-void isr_gpf_stub_handler(int int_no, uint32_t error_code) {
-  serial_write_dec(int_no);
-  serial_write_hex32(error_code);
 
+// Entry of the double-fault task. Runs on its own stack, so it works even
+// when the faulting kernel stack has run into its guard page.
+void double_fault_task(void) {
+    uint32_t faulting_address;
+    asm volatile ("mov %%cr2, %0" : "=r" (faulting_address));
+    serial_enter_sync();
+
+    if (vmm_is_stack_guard(faulting_address) || vmm_is_stack_guard(tss_entry.esp)) {
+        write_serial_string("Kernel stack overflow: esp ");
+        serial_write_hex32(tss_entry.esp);
+        write_serial_string(" eip ");
+        serial_write_hex32(tss_entry.eip);
+        write_serial_string("\n");
+        panic("Exception: Double Fault (kernel stack overflow)");
+    }
+
+    serial_write_hex32(tss_entry.eip);
+    panic("Exception: Double Fault");
+}
+
+static void gpf_handler(struct interrupt_frame* frame) {
+    report_frame(frame);
     panic("Exception: General Protection Fault");
 }
 
 
-void isr_page_fault_stub_handler(int int_no, uint32_t error_code) {
+static void page_fault_handler(struct interrupt_frame* frame) {
+    uint32_t error_code = frame->err_code;
     uint32_t faulting_address;
     asm volatile ("mov %%cr2, %0" : "=r" (faulting_address));
 
+    // Demand-paged regions are backed here and the access is retried
+    if (vmm_handle_page_fault(faulting_address, error_code)) {
+        return;
+    }
+
+    TRACE3(PAGE_FAULT, faulting_address, error_code, 0);
+
+    if (vmm_is_stack_guard(faulting_address)) {
+        write_serial_string("Kernel stack overflow into guard page ");
+    }
+
     serial_write_hex32(faulting_address);
+    write_serial_string(" error code ");
+    serial_write_hex32(error_code);
+    write_serial_string(" eip ");
+    serial_write_hex32(frame->eip);
     
     // You might want a better formatted message but keep it simple for now
     panic("Exception: Page Fault at address %x");
 }
-void isr_generic_exception_stub_handler(int int_no, uint32_t error_code) {
-
-    serial_write_dec(int_no);
 
-    serial_write_hex32(error_code);
-    panic("Exception: Unknown Interrupt %d, error code %d");
+static void syscall_handler(struct interrupt_frame* frame) {
+    (void)frame;
+    write_serial_string("syscall");
 }
 
-void syscall(){
-
-    write_serial_string("syscall");
-}
\ No newline at end of file
+void exceptions_install(void) {
+    register_interrupt_handler(0, divide_by_zero_handler);
+    register_interrupt_handler(8, double_fault_handler);
+    register_interrupt_handler(13, gpf_handler);
+    register_interrupt_handler(14, page_fault_handler);
+    register_interrupt_handler(SYSCALL_VECTOR, syscall_handler);
+}
@@ -1,32 +1,55 @@
 #include "handler_init.h"
 #include "../alarm/panic.h"
 #include "../idt/idt.h"
+#include "../apic/apic.h"
+#include "../consol/serial.h"
 
-extern void isr_divide_by_zero_stub(void);
-extern void isr_double_fault_stub(void);
-extern void isr_gpf_stub(void);
-extern void isr_page_fault_stub(void);
-extern void isr_generic_exception_stub(void);
-extern void isr_syscall();
-
-
+static irq_handler_t interrupt_handlers[256];
 
 
 void handlers_install(void){
 
-    idt_set_gate(0, (uint32_t)isr_divide_by_zero_stub, 0x08, 0x8E);
-    idt_set_gate(8, (uint32_t)isr_double_fault_stub, 0x08, 0x8E);
-    idt_set_gate(13, (uint32_t)isr_gpf_stub, 0x08, 0x8E);
-    idt_set_gate(14, (uint32_t)isr_page_fault_stub, 0x08, 0x8E);
-    idt_set_gate(0x80, (uint32_t)isr_syscall, 0x08, 0xEE);
-
-
     for (int i = 0; i < 256; i++) {
-        if (i != 0 && i != 8 && i != 13 && i != 14) {
-            idt_set_gate(i, (uint32_t)isr_generic_exception_stub, 0x08, 0x8E);
-        }
+        idt_set_gate(i, isr_stub_table[i], 0x08, 0x8E);
     }
 
+    // Reachable with int 0x80 from ring 3
+    idt_set_gate(SYSCALL_VECTOR, isr_stub_table[SYSCALL_VECTOR], 0x08, 0xEE);
+
+    exceptions_install();
+}
+
+void register_interrupt_handler(uint8_t vector, irq_handler_t handler) {
+    interrupt_handlers[vector] = handler;
+}
+
+void register_irq_handler(uint8_t irq, irq_handler_t handler) {
+    register_interrupt_handler(IRQ_BASE + irq, handler);
 }
 
+void interrupt_dispatch(struct interrupt_frame* frame) {
+    uint32_t vector = frame->int_no;
+    irq_handler_t handler = interrupt_handlers[vector];
+    int legacy = vector >= IRQ_BASE && vector < IRQ_BASE + IRQ_COUNT;
+    int local = vector >= LOCAL_IRQ_BASE && vector < LOCAL_IRQ_BASE + LOCAL_IRQ_COUNT;
+
+    if (handler) {
+        handler(frame);
+    } else if (!legacy && !local) {
+        write_serial_string("Unhandled interrupt ");
+        serial_write_dec(vector);
+        write_serial_string(" error code ");
+        serial_write_hex32(frame->err_code);
+        write_serial_string(" eip ");
+        serial_write_hex32(frame->eip);
+        write_serial_string("\n");
+        panic("Exception: Unhandled Interrupt");
+    }
 
+    // Unclaimed IRQs are acknowledged too, or the line stays blocked
+    if (legacy) {
+        irq_eoi(vector - IRQ_BASE);
+    } else if (local) {
+        lapic_eoi();
+    }
+}
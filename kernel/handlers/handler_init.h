@@ -3,7 +3,38 @@
 
 #include "../stdint.h"
 
+#define IRQ_BASE 0x20                     // PIC remapped vector of IRQ0
+#define IRQ_COUNT 16
+#define LOCAL_IRQ_BASE 0x40               // local APIC sources such as its timer
+#define LOCAL_IRQ_COUNT 16
+#define SYSCALL_VECTOR 0x80
+
+// Stack layout built by isr_common in isr_stub.s, lowest address first.
+// useresp and ss are only there when the interrupt came from ring 3.
+struct interrupt_frame {
+    uint32_t gs, fs, es, ds;
+    uint32_t edi, esi, ebp, esp_dummy, ebx, edx, ecx, eax;   // pusha
+    uint32_t int_no, err_code;
+    uint32_t eip, cs, eflags, useresp, ss;                   // pushed by the CPU
+};
+
+// Entry stub of every vector, from isr_stub.s
+extern uint32_t isr_stub_table[256];
+
+typedef void (*irq_handler_t)(struct interrupt_frame* frame);
+
 // Initialization function
 void handlers_install(void);
 
-#endif
\ No newline at end of file
+// One handler per vector, replaced on every call; NULL removes it. IRQ and
+// local APIC handlers do not send the EOI, the dispatcher does after they
+// return.
+void register_interrupt_handler(uint8_t vector, irq_handler_t handler);
+void register_irq_handler(uint8_t irq, irq_handler_t handler);
+
+void interrupt_dispatch(struct interrupt_frame* frame);
+
+// Registers the CPU exception and syscall handlers from exception.c
+void exceptions_install(void);
+
+#endif
@@ -1,70 +1,66 @@
 section .text
 
 
-extern isr_divide_by_zero_stub_handler
-extern isr_double_fault_stub_handler
-extern isr_gpf_stub_handler
-extern isr_page_fault_stub_handler
-extern isr_generic_exception_stub_handler
-extern syscall
+extern interrupt_dispatch
 
-global isr_divide_by_zero_stub
-isr_divide_by_zero_stub:
-    cli
-    push dword 0              ; dummy error code (no error code for #DE)
-    push dword 0              ; interrupt number 0
-    call isr_divide_by_zero_stub_handler
-    add esp, 8
-    sti
-    iret
+; One small stub per vector. Each pushes a dummy error code if the CPU does
+; not push one, then the vector number, so every vector reaches
+; isr_common with the same struct interrupt_frame layout (handler_init.h).
 
-global isr_double_fault_stub
-isr_double_fault_stub:
-    cli
-    push dword [esp + 8]      ; push error code from stack
-    push dword 8              ; interrupt number 8
-    call isr_double_fault_stub_handler
-    add esp, 8
-    sti
-    iret
+; Vectors where the CPU pushes an error code: #DF, #TS, #NP, #SS, #GP,
+; #PF, #AC, #CP, #VC, #SX
+%assign vec 0
+%rep 256
+isr_stub_ %+ vec:
+%if !(vec == 8 || (vec >= 10 && vec <= 14) || vec == 17 || vec == 21 || vec == 29 || vec == 30)
+    push dword 0              ; dummy error code
+%endif
+    push dword vec            ; vector number
+    jmp isr_common
+%assign vec vec + 1
+%endrep
 
-global isr_gpf_stub
-isr_gpf_stub:
-    cli
-    push dword [esp + 8]      ; push error code from stack
-    push dword 13             ; interrupt number 13
-    call isr_gpf_stub_handler
-    add esp, 8
-    sti
-    iret
 
-global isr_page_fault_stub
-isr_page_fault_stub:
-    cli
-    push dword [esp + 8]      ; push error code from stack
-    push dword 14             ; interrupt number 14
-    call isr_page_fault_stub_handler
-    add esp, 8
-    sti
-    iret
+isr_common:
+    ; Gates are interrupt gates, so IF is already clear here
+    pusha
+    push ds
+    push es
+    push fs
+    push gs
 
-global isr_generic_exception_stub
-isr_generic_exception_stub:
-    cli
-    push dword 0              ; dummy error code (no error code here)
-    push dword 255            ; interrupt number 255 (example)
-    call isr_generic_exception_stub_handler
-    add esp, 8
-    sti
-    iret
+    mov ax, 0x10              ; kernel data segment, we may have come from ring 3
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
 
-global isr_syscall
+    push esp                  ; struct interrupt_frame*
+    call interrupt_dispatch
+    add esp, 4
 
-isr_syscall:
-    cli
-    pusha
-    call syscall
+    pop gs
+    pop fs
+    pop es
+    pop ds
     popa
+    add esp, 8                ; drop the vector number and error code
     iret
 
 
+; Bare gate for bench_interrupts: the hardware cost of int/iret alone
+global isr_bench_iret
+isr_bench_iret:
+    iret
+
+
+section .rodata
+
+; Entry address of every stub, indexed by vector, for handlers_install
+global isr_stub_table
+isr_stub_table:
+%assign vec 0
+%rep 256
+    dd isr_stub_ %+ vec
+%assign vec vec + 1
+%endrep
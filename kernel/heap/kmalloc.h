@@ -0,0 +1,29 @@
+#ifndef KMALLOC_H
+#define KMALLOC_H
+
+#include "../stdint.h"
+#include <stddef.h>
+
+// Requests up to KMALLOC_MAX_SMALL come from per-class slab caches, larger
+// ones fall through to page-granular vmm_alloc in the kernel heap.
+#define KMALLOC_MAX_SMALL 1536
+#define KMALLOC_CLASS_COUNT 14
+#define KMALLOC_LARGE_BUCKETS 64
+
+struct kmalloc_class_stats {
+    uint32_t size;               // object size of the class
+    uint32_t in_use;             // live objects
+    uint32_t slabs;
+    uint32_t free_slots;         // carved but unused objects in those slabs
+    uint64_t requested_bytes;    // lifetime sum of request sizes
+    uint64_t allocated_bytes;    // lifetime sum of class sizes handed out
+};
+
+void kmalloc_init(void);
+void* kmalloc(size_t size);
+void kfree(void* ptr);
+void kmalloc_get_class_stats(uint32_t class_index, struct kmalloc_class_stats* out);
+void kmalloc_print_stats(void);
+void kmalloc_run_inline_tests(void);
+
+#endif
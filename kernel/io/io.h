@@ -8,5 +8,37 @@ void outb(uint16_t port, uint8_t data);
 
 uint8_t inb(uint16_t port);
 
+// Time-stamp counter, for cycle counts in stats and benchmarks
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// Disable interrupts and return the previous EFLAGS, for short sections
+// that an interrupt handler must not see half done
+static inline uint32_t irq_save(void) {
+    uint32_t flags;
+    __asm__ volatile("pushf\n"
+                     "pop %0\n"
+                     "cli" : "=r"(flags) :: "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint32_t flags) {
+    __asm__ volatile("push %0\n"
+                     "popf" :: "r"(flags) : "memory", "cc");
+}
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+    __asm__ volatile("wrmsr" :: "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
 
 #endif
\ No newline at end of file
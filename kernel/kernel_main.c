@@ -11,9 +11,14 @@
 #include "usermode/user.h"
 #include "pmm/pmm.h"
 #include "vmm/vmm.h"
+#include "heap/kmalloc.h"
+#include "bench/bench.h"
+#include "trace/trace.h"
+#include "apic/apic.h"
 
 
 extern uint32_t __stack_top;
+extern void double_fault_task(void);
  extern uint64_t bitmap_phys_start;
  extern uint8_t* bitmap;
  extern size_t bitmap_size;
@@ -74,9 +79,30 @@ void kernel_main(uintptr_t  mb_info_addr) {
 
    pmm_mark_region_used(paging_region_start, physical_end - paging_region_start);
    vmm_init();
+   kmalloc_init();
+
+   // Interrupts from user mode land on a guard-paged stack, and double
+   // faults get a task of their own so an overflow is reported
+   uintptr_t interrupt_stack = vmm_alloc_kernel_stack();
+   if (!interrupt_stack) panic("Could not allocate the interrupt stack");
+   set_kernel_stack(interrupt_stack);
+   tss_install_double_fault(6, (uint32_t)paging_current_directory(), double_fault_task);
+
+   // Hand IRQs to the local and I/O APICs when the MADT describes them;
+   // otherwise the 8259s set up by pic_remap stay in charge
+   apic_init();
 
    vmm_run_inline_tests();
 
+   // The newer self tests and benchmarks cost boot time and write to the
+   // console, so only debug builds run them
+#ifdef KERNEL_DEBUG
+   kmalloc_run_inline_tests();
+   trace_run_inline_tests();
+   bench_memory_ops();
+   bench_interrupts();
+#endif
+
 
 
    
@@ -88,13 +114,17 @@ void kernel_main(uintptr_t  mb_info_addr) {
   serial_write_hex32(bitmap_phys_start);  
      
 
-   //paging_run_tests();
+#ifdef KERNEL_DEBUG
+   paging_run_tests();
+#endif
 
 
   
  
    
 
+    // Console output goes through the TX ring from here on
+    serial_enable_irq();
     asm volatile("sti");
     
 
@@ -105,7 +135,20 @@ void kernel_main(uintptr_t  mb_info_addr) {
 
  
 
-    while (1);
+    // Idle: top up the zeroed-page pool and drain the trace ring, sleep
+    // once there is nothing left to do. The ring is checked again with
+    // interrupts off; sti holds them off until hlt has started, so a
+    // record an IRQ adds after that check wakes the loop straight away.
+    while (1) {
+        if (pmm_zero_pool_refill() || trace_drain(TRACE_DRAIN_BATCH)) continue;
+
+        asm volatile("cli");
+        if (trace_pending()) {
+            asm volatile("sti");
+            continue;
+        }
+        asm volatile("sti; hlt");
+    }
 }
 
 
@@ -41,6 +41,9 @@ void parse_memory_map(uintptr_t mb_info_addr){
         }
         tag = (struct multiboot_tag *)((uintptr_t)tag + ((tag->size + 7) & ~7));
     }
+    // pmm_init, and the self test it runs in debug builds, is not reached
+    // yet. This runs from the low stub, before the higher half pmm_init is
+    // linked into is mapped, and early_pmm_init is still a placeholder.
     early_pmm_init(mem_regions, region_count);
     
 }
@@ -2,6 +2,8 @@
 #include "../memory_map.h"
 #include "../alarm/panic.h"
 #include "../consol/serial.h"
+#include "../consol/log.h"
+#include "../trace/trace.h"
 #include "../pmm/pmm.h"
 
 
@@ -15,6 +17,23 @@
 #define PTE_PRESENT 0x1
 #define PTE_RW 0x2
 #define PTE_USER 0x4
+#define PDE_LARGE 0x80                     // PDE.PS, entry maps a 4 MB page
+#define PTE_GLOBAL 0x100                   // survives CR3 reloads once CR4.PGE is set
+#define PTE_COW 0x200                      // available bit: read-only share, copy on write
+#define LARGE_PAGE_MASK (PAGE_LARGE_SIZE - 1)
+#define PD_VIRT ((uint32_t*)(RECURSIVE_BASE_VADDR + RECURSIVE_SLOT * PAGE_SIZE))
+#define KERNEL_PDE_FIRST (KERNEL_PHYS_WINDOW >> 22)
+
+// TEMP_MAP_ADDR slots. Each user holds its own so they can nest
+#define TEMP_SLOT_ZERO 0                   // paging_zero_frame
+#define TEMP_SLOT_DIR 1                    // a directory other than the active one
+#define TEMP_SLOT_TABLE 2                  // a page table not reachable recursively
+#define TEMP_SLOT_FRAME 3                  // a data frame being copied
+
+// Page tables in the user half and in the kernel heap / slab arena are
+// freed once their last PTE goes. Everything else is mapped for good.
+#define PT_RECLAIM_KERNEL_FIRST (0xC1000000 >> 22)
+#define PT_RECLAIM_KERNEL_END (TEMP_MAP_ADDR >> 22)
 #define ALIGN_UP(x, a) (((x) + ((a)-1)) & ~((a)-1))
 #define TEMP_VIRT_ADDR 0xCAFEB000 
 #define HIGHER_HALF_STACK_VADDR  ((void*)0xC0090000)
@@ -25,33 +44,146 @@
 static uint32_t* page_directory;
 static uint32_t* page_tables;
 
+static int pse_enabled = 0;
+static int pge_enabled = 0;
+
+// The active directory as the code can reach it: the physical pointer
+// until paging is on, the recursive mapping at 0xFFFFF000 after that.
+static uint32_t* active_pd;
+
+// Every live directory by physical address, so kernel-half PDE changes
+// can be copied into all of them. Slot 0 is the boot directory.
+static uintptr_t address_spaces[PAGING_MAX_ADDRESS_SPACES];
+static uint32_t address_space_count;
+static uintptr_t current_dir;
+static uint32_t pt_reclaimed;
+
+// Low PDEs of the boot identity map. The kernel image and the PMM metadata
+// are reached through them, so every directory shares them supervisor-only.
+static uint32_t identity_pde_count;
+
+static void pde_set(uint32_t pd_index, uint32_t value);
+static void pt_init(uintptr_t pt_phys, uint32_t entries);
+static void pt_count(uintptr_t pt_phys, int32_t delta);
+
+static inline int paging_enabled(void) {
+    uint32_t cr0;
+    __asm__ volatile("mov %%cr0, %0" : "=r"(cr0));
+    return (cr0 & 0x80000000) != 0;
+}
+
+// 4 KB of zeroes with 32-bit string stores
+static inline void zero_page(void* page) {
+    uint32_t count = PAGE_SIZE / 4;
+    __asm__ volatile("rep stosl" : "+D"(page), "+c"(count) : "a"(0) : "memory");
+}
+
+// 4 KB copy with 32-bit string moves
+static inline void copy_page(void* dst, const void* src) {
+    uint32_t count = PAGE_SIZE / 4;
+    __asm__ volatile("rep movsl" : "+D"(dst), "+S"(src), "+c"(count) :: "memory");
+}
+
 // Helper: flush TLB for a single page
 static inline void flush_tlb_single(uintptr_t addr) {
-    write_serial_string("[flush_tlb_single] Flushing TLB for addr: 0x");
-    serial_write_hex32((uint32_t)addr);
-      write_serial_string("\n");
+    KLOG_TRACE(PAGING, "[flush_tlb_single] %x\n", (uint32_t)addr);
     __asm__ volatile("invlpg (%0)" ::"r"(addr) : "memory");
 }
 
+// CPUID.1:EDX bit 3 advertises 4 MB pages
+static int cpu_has_pse(void) {
+    uint32_t eax = 1, ebx, ecx = 0, edx;
+    __asm__ volatile("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+    return (edx & (1 << 3)) != 0;
+}
+
+// Set CR4.PSE when the CPU supports it. Returns 1 if 4 MB pages are usable.
+int paging_enable_pse(void) {
+    if (pse_enabled) return 1;
+    if (!cpu_has_pse()) return 0;
+
+    uint32_t cr4;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+    cr4 |= 0x10;
+    __asm__ volatile("mov %0, %%cr4" ::"r"(cr4) : "memory");
+    pse_enabled = 1;
+    return 1;
+}
+
+// CPUID.1:EDX bit 13 advertises global pages
+static int cpu_has_pge(void) {
+    uint32_t eax = 1, ebx, ecx = 0, edx;
+    __asm__ volatile("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+    return (edx & (1 << 13)) != 0;
+}
+
+// Set CR4.PGE when the CPU supports it. Returns 1 if global pages are usable.
+int paging_enable_pge(void) {
+    if (pge_enabled) return 1;
+    if (!cpu_has_pge()) return 0;
+
+    uint32_t cr4;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+    cr4 |= 0x80;
+    __asm__ volatile("mov %0, %%cr4" ::"r"(cr4) : "memory");
+    pge_enabled = 1;
+    return 1;
+}
+
+// Global bit for a mapping at virt. Only the kernel half is shared by every
+// address space; the recursive slot differs per directory and stays local.
+static inline uint32_t kernel_global(uintptr_t virt) {
+    if (!pge_enabled) return 0;
+    if (virt < KERNEL_PHYS_WINDOW || virt >= RECURSIVE_BASE_VADDR) return 0;
+    return PTE_GLOBAL;
+}
+
+// Flush every TLB entry including global ones. Toggling CR4.PGE is the
+// only way to drop global entries wholesale; a CR3 reload leaves them.
+void paging_flush_tlb_global(void) {
+    uint32_t cr4;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+    if (cr4 & 0x80) {
+        __asm__ volatile("mov %0, %%cr4\n"
+                         "mov %1, %%cr4" ::"r"(cr4 & ~0x80), "r"(cr4) : "memory");
+    } else {
+        uint32_t cr3;
+        __asm__ volatile("mov %%cr3, %0\n"
+                         "mov %0, %%cr3" : "=r"(cr3) :: "memory");
+    }
+}
+
 
 
 void map_physical_memory_window(uintptr_t max_phys) {
+    int large = paging_enable_pse();
+    paging_enable_pge();
+
     for (uintptr_t phys = 0; phys < max_phys; phys += PAGE_SIZE) {
         uintptr_t virt = KERNEL_PHYS_WINDOW + phys;
 
         uint32_t pd_index = (virt >> 22) & 0x3FF;
         uint32_t pt_index = (virt >> 12) & 0x3FF;
 
-        if (!(page_directory[pd_index] & PDE_PRESENT)) {
-            uint32_t* new_pt = (uint32_t*)pmm_alloc_page();
+        // Whole 4 MB chunks with an empty PDE take a single large entry
+        if (large && pt_index == 0 && max_phys - phys >= PAGE_LARGE_SIZE &&
+            !(active_pd[pd_index] & PDE_PRESENT)) {
+            pde_set(pd_index, phys | PDE_PRESENT | PDE_RW | PDE_LARGE | kernel_global(virt));
+            phys += PAGE_LARGE_SIZE - PAGE_SIZE;
+            continue;
+        }
+
+        if (!(active_pd[pd_index] & PDE_PRESENT)) {
+            uint32_t* new_pt = (uint32_t*)pmm_alloc_zeroed_page();
             if (!new_pt) panic("Out of memory for PT");
 
-            memset(new_pt, 0, PAGE_SIZE);
-            page_directory[pd_index] = ((uintptr_t)new_pt) | PDE_PRESENT | PDE_RW;
+            pt_init((uintptr_t)new_pt, 0);
+            pde_set(pd_index, ((uintptr_t)new_pt) | PDE_PRESENT | PDE_RW);
         }
 
-        uint32_t* page_table = (uint32_t*)(page_directory[pd_index] & ~0xFFF);
-        page_table[pt_index] = (phys & ~0xFFF) | PTE_PRESENT | PTE_RW;
+        uint32_t* page_table = (uint32_t*)(active_pd[pd_index] & ~0xFFF);
+        if (!(page_table[pt_index] & PTE_PRESENT)) pt_count(active_pd[pd_index], 1);
+        page_table[pt_index] = (phys & ~0xFFF) | PTE_PRESENT | PTE_RW | kernel_global(virt);
     }
 }
 
@@ -59,129 +191,666 @@ uint32_t* get_page_table_virt(uint32_t pd_index) {
     return (uint32_t*)(RECURSIVE_BASE_VADDR + (pd_index * PAGE_SIZE));
 }
 
+// Map a frame into one of the TEMP_MAP_ADDR slots and return a pointer to
+// it. The slots' page table is built from a plain pmm_alloc_page so this
+// never recurses into the zeroed-page pool. It exists before any second
+// address space does, so pde_set has no other directory to update here.
+static void* temp_map(uint32_t slot, uintptr_t phys) {
+    if (!paging_enabled()) return (void*)phys;
 
-void paging_map_page(uintptr_t virt, uintptr_t phys, uint32_t flags){
-     write_serial_string("[paging_map_page] Called with virt=0x");
-    serial_write_hex32((uint32_t)virt);
-    write_serial_string(", phys=0x");
-    serial_write_hex32((uint32_t)phys);
-    write_serial_string(", flags=0x");
-    serial_write_hex32(flags);
-    write_serial_string("\n");
-
-
+    uintptr_t virt = TEMP_MAP_ADDR + slot * PAGE_SIZE;
     uint32_t pd_index = (virt >> 22) & 0x3FF;
     uint32_t pt_index = (virt >> 12) & 0x3FF;
 
-    write_serial_string("[paging_map_page] Calculated pd_index=0x");
-    serial_write_hex32(pd_index);
-    write_serial_string(", pt_index=0x");
-    serial_write_hex32(pt_index);
-    write_serial_string("\n");
+    if (!(active_pd[pd_index] & PDE_PRESENT)) {
+        uint32_t pt_phys = pmm_alloc_page();
+        pt_init(pt_phys, 0);
+        active_pd[pd_index] = pt_phys | PDE_PRESENT | PDE_RW;
+        __asm__ volatile("invlpg (%0)" ::"r"(get_page_table_virt(pd_index)) : "memory");
+        zero_page(get_page_table_virt(pd_index));
+        pde_set(pd_index, active_pd[pd_index]);
+    }
 
+    uint32_t* pt = get_page_table_virt(pd_index);
+    pt[pt_index] = (phys & ~0xFFF) | PTE_PRESENT | PTE_RW | kernel_global(virt);
+    __asm__ volatile("invlpg (%0)" ::"r"(virt) : "memory");
+    return (void*)virt;
+}
 
-    uint32_t pd_entry = page_directory[pd_index];
-    write_serial_string("[paging_map_page] PDE value: 0x");
-    serial_write_hex32(pd_entry);
-    write_serial_string("\n");
+static void temp_unmap(uint32_t slot) {
+    if (!paging_enabled()) return;
 
+    uintptr_t virt = TEMP_MAP_ADDR + slot * PAGE_SIZE;
+    uint32_t* pt = get_page_table_virt((virt >> 22) & 0x3FF);
+    pt[(virt >> 12) & 0x3FF] = 0;
+    __asm__ volatile("invlpg (%0)" ::"r"(virt) : "memory");
+}
 
+// Write a PDE in the active directory. Kernel-half and identity-map PDEs
+// point at page tables that every address space shares, so a change there
+// is copied into each other registered directory too.
+static void pde_set(uint32_t pd_index, uint32_t value) {
+    active_pd[pd_index] = value;
+    if (pd_index >= RECURSIVE_SLOT) return;
+    if (pd_index < KERNEL_PDE_FIRST && pd_index >= identity_pde_count) return;
+
+    for (uint32_t i = 0; i < address_space_count; i++) {
+        if (address_spaces[i] == current_dir) continue;
+        uint32_t* dir = (uint32_t*)temp_map(TEMP_SLOT_DIR, address_spaces[i]);
+        dir[pd_index] = value;
+        temp_unmap(TEMP_SLOT_DIR);
+    }
+}
 
-    if(!(pd_entry & PDE_PRESENT)){
-         write_serial_string("[paging_map_page] PDE not present, allocating new page table\n");
-      uint32_t pt_phys = pmm_alloc_page(); 
-        if (!pt_phys ) {
-      panic("Out of memory: failed to allocate page table");
-     }
+// Each page table's present-entry count lives in its frame's descriptor.
+// Frames paging did not allocate (the boot tables) carry no count.
+static void pt_init(uintptr_t pt_phys, uint32_t entries) {
+    pmm_page_set_state(pt_phys, PG_PAGETABLE, PG_OWNER_PAGING);
+    struct page* desc = pmm_phys_to_page(pt_phys);
+    if (desc) desc->pt_entries = entries;
+}
 
-   
-    
+static void pt_count(uintptr_t pt_phys, int32_t delta) {
+    struct page* desc = pmm_phys_to_page(pt_phys & ~0xFFF);
+    if (!desc || !(desc->flags & PG_PAGETABLE) || !delta) return;
+    if (delta < 0 && desc->pt_entries < (uint32_t)-delta) {
+        panic("paging: page table entry count underflow");
+    }
+    desc->pt_entries += delta;
+}
+
+// Frames the PMM handed out. Firmware, kernel image and device frames can
+// sit behind user PTEs too; they are shared as they are and never gain or
+// drop a reference here.
+static inline int frame_is_managed(uintptr_t phys) {
+    struct page* desc = pmm_phys_to_page(phys);
+    return desc && desc->refcount && !(desc->flags & PG_RESERVED);
+}
+
+static inline int pt_reclaimable(uint32_t pd_index) {
+    return pd_index < KERNEL_PDE_FIRST ||
+           (pd_index >= PT_RECLAIM_KERNEL_FIRST && pd_index < PT_RECLAIM_KERNEL_END);
+}
 
-        
-         write_serial_string("[paging_map_page] New PT phys addr: 0x");
-        serial_write_hex32((uint32_t)pt_phys);
-        write_serial_string("\n");
-        page_directory[pd_index] = pt_phys | PDE_PRESENT | PDE_RW | PDE_USER;
-        flush_tlb_single(0xFFFFF000 + (pd_index * PAGE_SIZE)); 
+// Free the page table behind pd_index if nothing is mapped through it any
+// more. The PDE goes first, then the table's recursive-mapping TLB entry;
+// the caller still owes the invalidations for the pages it just unmapped.
+static void pt_reclaim_if_empty(uint32_t pd_index) {
+    uint32_t pde = active_pd[pd_index];
+    if (!(pde & PDE_PRESENT) || (pde & PDE_LARGE) || !pt_reclaimable(pd_index)) return;
+
+    struct page* desc = pmm_phys_to_page(pde & ~0xFFF);
+    if (!desc || !(desc->flags & PG_PAGETABLE) || desc->pt_entries) return;
+
+    pde_set(pd_index, 0);
+    __asm__ volatile("invlpg (%0)" ::"r"(get_page_table_virt(pd_index)) : "memory");
+    pmm_free_page(pde & ~0xFFF);
+    pt_reclaimed++;
+    TRACE2(PT_RECLAIM, pd_index, pde & ~0xFFF);
+}
 
+uint32_t paging_reclaimed_tables(void) {
+    return pt_reclaimed;
+}
 
-        uint32_t* pt_virt = get_page_table_virt(pd_index);
-        memset(pt_virt, 0, PAGE_SIZE);
+// Replace a 4 MB PDE with a page table mapping the same 1024 frames with
+// the same flags. The table is filled through the temp slot before the PDE
+// switches over, so the range stays mapped the whole time.
+static void paging_split_large(uint32_t pd_index) {
+    uint32_t entry = active_pd[pd_index];
+    uint32_t base = entry & ~LARGE_PAGE_MASK;
+    uint32_t pte_flags = entry & 0xFFF & ~PDE_LARGE;
+    uint32_t pde_flags = PDE_PRESENT | PDE_RW | (entry & PDE_USER);
+
+    uint32_t pt_phys = pmm_alloc_page();
+    pt_init(pt_phys, PAGE_ENTRIES);
+
+    uint32_t* pt = (uint32_t*)temp_map(TEMP_SLOT_TABLE, pt_phys);
+    for (uint32_t i = 0; i < PAGE_ENTRIES; i++) {
+        pt[i] = (base + i * PAGE_SIZE) | pte_flags;
+    }
+    temp_unmap(TEMP_SLOT_TABLE);
 
+    pde_set(pd_index, pt_phys | pde_flags);
+    __asm__ volatile("invlpg (%0)" ::"r"(pd_index << 22) : "memory");
+    __asm__ volatile("invlpg (%0)" ::"r"(get_page_table_virt(pd_index)) : "memory");
+}
 
-         write_serial_string("[paging_map_page] Updated PDE at index ");
-        serial_write_hex32(pd_index);
-        write_serial_string(" to 0x");
-        serial_write_hex32(page_directory[pd_index]);
-        write_serial_string("\n");
-    
+// Return the page table covering pd_index through the recursive mapping,
+// allocating a zeroed one if the PDE is empty and splitting a 4 MB page.
+static uint32_t* paging_get_table(uint32_t pd_index) {
+    if ((active_pd[pd_index] & PDE_PRESENT) && (active_pd[pd_index] & PDE_LARGE)) {
+        paging_split_large(pd_index);
+    } else if (!(active_pd[pd_index] & PDE_PRESENT)) {
+        uint32_t pt_phys = pmm_alloc_zeroed_page();
+        if (!pt_phys) {
+            panic("Out of memory: failed to allocate page table");
+        }
+        pt_init(pt_phys, 0);
+        pde_set(pd_index, pt_phys | PDE_PRESENT | PDE_RW | PDE_USER);
+        __asm__ volatile("invlpg (%0)" ::"r"(get_page_table_virt(pd_index)) : "memory");
     }
+    return get_page_table_virt(pd_index);
+}
 
-    uint32_t* page_table = get_page_table_virt(pd_index);
-     write_serial_string("[paging_map_page] Page table address: 0x");
-    serial_write_hex32((uint32_t)page_table);
-    write_serial_string("\n");
 
-     write_serial_string("[paging_map_page] Setting PTE at index ");
-    serial_write_hex32(pt_index);
-    write_serial_string(" to phys addr 0x");
-    serial_write_hex32((phys & ~0xFFF));
-    write_serial_string(" with flags 0x");
-    serial_write_hex32(flags & 0xFFF);
-    write_serial_string("\n");
+// TLB shootdown batch for the range calls. Addresses are queued while the
+// range is walked and flushed once at the end: one invlpg each while the
+// batch stays at or below the threshold, a single CR3 reload past it. A
+// CR3 reload keeps global entries, so batches holding one flush fully.
+static uint32_t tlb_flush_threshold = PAGING_TLB_FLUSH_THRESHOLD;
 
-    page_table[pt_index] = (phys & ~0xFFF) | (flags & 0xFFF) | PTE_PRESENT;
+struct tlb_batch {
+    uint32_t count;
+    int global;
+    uintptr_t addrs[PAGING_TLB_BATCH_MAX];
+};
+
+static inline void tlb_batch_add(struct tlb_batch* batch, uintptr_t virt, uint32_t old_entry) {
+    if (batch->count < PAGING_TLB_BATCH_MAX) {
+        batch->addrs[batch->count] = virt;
+    }
+    batch->count++;
+    if (old_entry & PTE_GLOBAL) batch->global = 1;
+}
+
+static inline void flush_tlb_all(void) {
+    uint32_t cr3;
+    __asm__ volatile("mov %%cr3, %0\n"
+                     "mov %0, %%cr3" : "=r"(cr3) :: "memory");
+}
+
+static void tlb_batch_flush(struct tlb_batch* batch) {
+    if (batch->count > tlb_flush_threshold && batch->global) {
+        paging_flush_tlb_global();
+    } else if (batch->count > tlb_flush_threshold) {
+        flush_tlb_all();
+    } else {
+        for (uint32_t i = 0; i < batch->count; i++) {
+            __asm__ volatile("invlpg (%0)" ::"r"(batch->addrs[i]) : "memory");
+        }
+    }
+    batch->count = 0;
+    batch->global = 0;
+}
+
+void paging_set_tlb_flush_threshold(uint32_t pages) {
+    if (pages > PAGING_TLB_BATCH_MAX) pages = PAGING_TLB_BATCH_MAX;
+    tlb_flush_threshold = pages;
+}
+
+// Shared body of the map_range calls: phys_list wins when given, otherwise
+// the frames are contiguous from phys. Each page table is looked up once
+// and its PTEs filled in one pass. Contiguous runs that cover a whole,
+// 4 MB aligned PDE become one large page when PSE is on.
+static void paging_map_range_common(uintptr_t virt, uintptr_t phys, const uintptr_t* phys_list,
+                                    uint32_t count, uint32_t flags) {
+    struct tlb_batch batch;
+    batch.count = 0;
+    batch.global = 0;
+
+    uint32_t done = 0;
+    while (done < count) {
+        uint32_t pd_index = (virt >> 22) & 0x3FF;
+        uint32_t pt_index = (virt >> 12) & 0x3FF;
+        uint32_t run = PAGE_ENTRIES - pt_index;
+        if (run > count - done) run = count - done;
+
+        uintptr_t frame_base = phys + done * PAGE_SIZE;
+        uint32_t pde = active_pd[pd_index];
+        if (!phys_list && pse_enabled && run == PAGE_ENTRIES && !(frame_base & LARGE_PAGE_MASK) &&
+            (!(pde & PDE_PRESENT) || (pde & PDE_LARGE))) {
+            pde_set(pd_index, frame_base | (flags & 0xFFF) | PDE_PRESENT | PDE_LARGE | kernel_global(virt));
+            if (pde & PDE_PRESENT) {
+                // A different 4 MB page was here: its frames lose this
+                // mapping's reference, as paging_unmap_range would drop it
+                uintptr_t old_base = pde & ~LARGE_PAGE_MASK;
+                for (uint32_t i = 0; old_base != frame_base && i < PAGE_ENTRIES; i++) {
+                    if (frame_is_managed(old_base + i * PAGE_SIZE)) pmm_free_page(old_base + i * PAGE_SIZE);
+                }
+                tlb_batch_add(&batch, virt, pde);
+            }
+            done += run;
+            virt += PAGE_LARGE_SIZE;
+            continue;
+        }
+
+        uint32_t* pt = paging_get_table(pd_index);
+        uint32_t pte_flags = (flags & 0xFFF & ~PDE_LARGE) | PTE_PRESENT | kernel_global(virt);
+        uint32_t added = 0;
+
+        for (uint32_t i = 0; i < run; i++) {
+            uintptr_t frame = phys_list ? phys_list[done + i] : phys + (done + i) * PAGE_SIZE;
+            uint32_t old = pt[pt_index + i];
+            pt[pt_index + i] = (frame & ~0xFFF) | pte_flags;
+            // Non-present entries are never cached, only overwritten ones need flushing
+            if (old & PTE_PRESENT) {
+                tlb_batch_add(&batch, virt + i * PAGE_SIZE, old);
+            } else {
+                added++;
+            }
+        }
+        pt_count(active_pd[pd_index], added);
+
+        done += run;
+        virt += run * PAGE_SIZE;
+    }
+
+    tlb_batch_flush(&batch);
+}
+
+void paging_map_range(uintptr_t virt, uintptr_t phys, uint32_t count, uint32_t flags) {
+    paging_map_range_common(virt, phys, NULL, count, flags);
+}
+
+void paging_map_range_list(uintptr_t virt, const uintptr_t* phys_list, uint32_t count, uint32_t flags) {
+    paging_map_range_common(virt, 0, phys_list, count, flags);
+}
+
+// Unmap count pages from virt and drop each frame's reference, skipping
+// whole page tables that are not present.
+void paging_unmap_range(uintptr_t virt, uint32_t count) {
+    struct tlb_batch batch;
+    batch.count = 0;
+    batch.global = 0;
+
+    uint32_t done = 0;
+    while (done < count) {
+        uint32_t pd_index = (virt >> 22) & 0x3FF;
+        uint32_t pt_index = (virt >> 12) & 0x3FF;
+        uint32_t run = PAGE_ENTRIES - pt_index;
+        if (run > count - done) run = count - done;
+
+        uint32_t pde = active_pd[pd_index];
+        if ((pde & PDE_PRESENT) && (pde & PDE_LARGE) && run < PAGE_ENTRIES) {
+            paging_split_large(pd_index);
+            pde = active_pd[pd_index];
+        }
+
+        if ((pde & PDE_PRESENT) && (pde & PDE_LARGE)) {
+            // Whole 4 MB page: drop the PDE and each frame's reference
+            pde_set(pd_index, 0);
+            for (uint32_t i = 0; i < PAGE_ENTRIES; i++) {
+                pmm_free_page((pde & ~LARGE_PAGE_MASK) + i * PAGE_SIZE);
+            }
+            tlb_batch_add(&batch, virt, pde);
+        } else if (pde & PDE_PRESENT) {
+            uint32_t* pt = get_page_table_virt(pd_index);
+            uint32_t removed = 0;
+            for (uint32_t i = 0; i < run; i++) {
+                uint32_t entry = pt[pt_index + i];
+                if (!(entry & PTE_PRESENT)) continue;
+
+                pt[pt_index + i] = 0;
+                pmm_free_page(entry & ~0xFFF);
+                tlb_batch_add(&batch, virt + i * PAGE_SIZE, entry);
+                removed++;
+            }
+            pt_count(pde, -(int32_t)removed);
+            pt_reclaim_if_empty(pd_index);
+        }
+
+        done += run;
+        virt += run * PAGE_SIZE;
+    }
+
+    tlb_batch_flush(&batch);
+}
+
+
+// Number of 4 MB pages mapped anywhere in [virt, virt + count pages)
+uint32_t paging_count_large(uintptr_t virt, uint32_t count) {
+    if (!count) return 0;
+
+    uint32_t first = (virt >> 22) & 0x3FF;
+    uint32_t last = ((virt + (count - 1) * PAGE_SIZE) >> 22) & 0x3FF;
+    uint32_t large = 0;
+    for (uint32_t i = first; i <= last; i++) {
+        if ((active_pd[i] & PDE_PRESENT) && (active_pd[i] & PDE_LARGE)) large++;
+    }
+    return large;
+}
+
+void paging_map_page(uintptr_t virt, uintptr_t phys, uint32_t flags){
+    KLOG_DEBUG(PAGING, "[paging_map_page] virt=%x phys=%x flags=%x\n",
+               (uint32_t)virt, (uint32_t)phys, flags);
+
+
+    uint32_t pd_index = (virt >> 22) & 0x3FF;
+    uint32_t pt_index = (virt >> 12) & 0x3FF;
+
+
+
+    uint32_t pd_entry = active_pd[pd_index];
+    KLOG_TRACE(PAGING, "[paging_map_page] pd_index=%x pt_index=%x pde=%x\n", pd_index, pt_index, pd_entry);
+
+    if (flags & PAGE_LARGE) {
+        // Without PSE a 4 MB request becomes 1024 small pages
+        if (!pse_enabled) {
+            paging_map_range(virt & ~LARGE_PAGE_MASK, phys & ~LARGE_PAGE_MASK, PAGE_ENTRIES,
+                             flags & ~PAGE_LARGE);
+            return;
+        }
+        if ((pd_entry & PDE_PRESENT) && !(pd_entry & PDE_LARGE)) {
+            panic("paging_map_page: 4 MB page over an existing page table");
+        }
+
+        pde_set(pd_index, (phys & ~LARGE_PAGE_MASK) | (flags & 0xFFF) | PDE_PRESENT | kernel_global(virt));
+        flush_tlb_single(virt);
+        return;
+    }
+
+
+    if(!(pd_entry & PDE_PRESENT)){
+        KLOG_TRACE(PAGING, "[paging_map_page] PDE not present, allocating new page table\n");
+    }
+    paging_get_table(pd_index);
+
+    uint32_t* page_table = get_page_table_virt(pd_index);
+
+    if (!(page_table[pt_index] & PTE_PRESENT)) pt_count(active_pd[pd_index], 1);
+    page_table[pt_index] = (phys & ~0xFFF) | (flags & 0xFFF) | PTE_PRESENT | kernel_global(virt);
 
     flush_tlb_single(virt);
 }
 
 void paging_unmap_page(uintptr_t virtual_addr) {
 
-    write_serial_string("[paging_unmap_page] Called with virtual_addr=0x");
-    serial_write_hex32((uint32_t)virtual_addr);
-    write_serial_string("\n");
+    KLOG_DEBUG(PAGING, "[paging_unmap_page] virt=%x\n", (uint32_t)virtual_addr);
 
     uint32_t pd_index = (virtual_addr >> 22) & 0x3FF;
     uint32_t pt_index = (virtual_addr >> 12) & 0x3FF;
 
-     write_serial_string("[paging_unmap_page] pd_index=0x");
-    serial_write_hex32(pd_index);
-    write_serial_string(", pt_index=0x");
-    serial_write_hex32(pt_index);
-    write_serial_string("\n");
 
-    if (!(page_directory[pd_index] & PDE_PRESENT)) {
-        write_serial_string("[paging_unmap_page] PDE not present, nothing to unmap\n");
+    if (!(active_pd[pd_index] & PDE_PRESENT)) {
+        KLOG_TRACE(PAGING, "[paging_unmap_page] PDE not present, nothing to unmap\n");
         return; // Page table not present
     }
 
+    if (active_pd[pd_index] & PDE_LARGE) {
+        KLOG_TRACE(PAGING, "[paging_unmap_page] splitting 4 MB page\n");
+        paging_split_large(pd_index);
+    }
+
    uint32_t* pt = get_page_table_virt(pd_index);
 
-    write_serial_string("[paging_unmap_page] Page table address: 0x");
-    serial_write_hex32((uint32_t)pt);
-    write_serial_string("\n");
     uint32_t entry = pt[pt_index];
 
-    write_serial_string("[paging_unmap_page] PTE value: 0x");
-    serial_write_hex32(entry);
-    write_serial_string("\n");
+    KLOG_TRACE(PAGING, "[paging_unmap_page] pd_index=%x pt_index=%x pte=%x\n", pd_index, pt_index, entry);
 
 
     if (!(entry & PTE_PRESENT)) {
-         write_serial_string("[paging_unmap_page] PTE not present, nothing to unmap\n");
+        KLOG_TRACE(PAGING, "[paging_unmap_page] PTE not present, nothing to unmap\n");
         return; // Page not mapped
     }
 
     uintptr_t phys_addr = entry & ~0xFFF;
-    write_serial_string("[paging_unmap_page] Freeing physical page at 0x");
-    serial_write_hex32((uint32_t)phys_addr);
-    write_serial_string("\n");
 
-    pmm_free_page((void*)phys_addr);  // Free the physical frame
+    pmm_free_page(phys_addr);  // Drop this mapping's reference, frees the frame if it was the last
 
     pt[pt_index] = 0; // Clear the entry
+    pt_count(active_pd[pd_index], -1);
 
     flush_tlb_single(virtual_addr);
+    pt_reclaim_if_empty(pd_index);
+}
+
+
+// Zero a physical frame through its own temp slot, so it can run while
+// the address-space code holds the others.
+void paging_zero_frame(uintptr_t phys) {
+    zero_page(temp_map(TEMP_SLOT_ZERO, phys));
+    temp_unmap(TEMP_SLOT_ZERO);
+}
+
+
+// Address spaces. A directory is handled by its physical address, the same
+// way page_directory is. The kernel half of every directory points at the
+// same page tables, and so do the low identity-map PDEs, so creating one
+// copies those PDEs and nothing else.
+
+// Install a PTE in dir, which need not be the active directory. User page
+// tables are allocated here on first use.
+static void dir_set_pte(uintptr_t dir_phys, uintptr_t virt, uint32_t entry) {
+    uint32_t pd_index = (virt >> 22) & 0x3FF;
+    uint32_t pt_index = (virt >> 12) & 0x3FF;
+
+    if (dir_phys == current_dir) {
+        uint32_t* pt = paging_get_table(pd_index);
+        uint32_t old = pt[pt_index];
+        pt[pt_index] = entry;
+        if (old & PTE_PRESENT) {
+            __asm__ volatile("invlpg (%0)" ::"r"(virt) : "memory");
+        } else {
+            pt_count(active_pd[pd_index], 1);
+        }
+        return;
+    }
+
+    uint32_t* dir = (uint32_t*)temp_map(TEMP_SLOT_DIR, dir_phys);
+    if (!(dir[pd_index] & PDE_PRESENT)) {
+        uint32_t new_pt = pmm_alloc_zeroed_page();
+        pt_init(new_pt, 0);
+        dir[pd_index] = new_pt | PDE_PRESENT | PDE_RW | PDE_USER;
+    }
+    if (dir[pd_index] & PDE_LARGE) {
+        panic("dir_set_pte: 4 MB page in an inactive directory");
+    }
+    uint32_t pt_phys = dir[pd_index] & ~0xFFF;
+    temp_unmap(TEMP_SLOT_DIR);
+
+    uint32_t* pt = (uint32_t*)temp_map(TEMP_SLOT_TABLE, pt_phys);
+    if (!(pt[pt_index] & PTE_PRESENT) && (entry & PTE_PRESENT)) pt_count(pt_phys, 1);
+    pt[pt_index] = entry;
+    temp_unmap(TEMP_SLOT_TABLE);
+}
+
+static void address_space_remove(uintptr_t dir_phys) {
+    for (uint32_t i = 0; i < address_space_count; i++) {
+        if (address_spaces[i] == dir_phys) {
+            address_spaces[i] = address_spaces[--address_space_count];
+            return;
+        }
+    }
+}
+
+// New directory with an empty user half, the shared kernel half and the
+// shared identity map. Returns NULL when PAGING_MAX_ADDRESS_SPACES are
+// already live.
+uint32_t* paging_create_user_directory(void) {
+    if (address_space_count >= PAGING_MAX_ADDRESS_SPACES) {
+        KLOG_WARN(PAGING, "[paging] Address space limit reached\n");
+        return NULL;
+    }
+
+    uint32_t dir_phys = pmm_alloc_zeroed_page();
+    pmm_page_set_state(dir_phys, PG_PAGETABLE, PG_OWNER_PAGING);
+
+    uint32_t* dir = (uint32_t*)temp_map(TEMP_SLOT_DIR, dir_phys);
+    memcpy(dir, active_pd, identity_pde_count * sizeof(uint32_t));
+    memcpy(&dir[KERNEL_PDE_FIRST], &active_pd[KERNEL_PDE_FIRST],
+           (RECURSIVE_SLOT - KERNEL_PDE_FIRST) * sizeof(uint32_t));
+    dir[RECURSIVE_SLOT] = dir_phys | PDE_PRESENT | PDE_RW;
+    temp_unmap(TEMP_SLOT_DIR);
+
+    address_spaces[address_space_count++] = dir_phys;
+    return (uint32_t*)dir_phys;
+}
+
+// Back virt in dir with a fresh zeroed frame. flags is PAGE_RX or PAGE_RW.
+void paging_map_user(uint32_t* dir, uintptr_t virt, uint32_t flags) {
+    if (virt >= KERNEL_PHYS_WINDOW) {
+        panic("paging_map_user: address is in the kernel half");
+    }
+    if ((virt >> 22) < identity_pde_count) {
+        panic("paging_map_user: address is in the shared identity map");
+    }
+
+    uint32_t frame = pmm_alloc_zeroed_page();
+    pmm_page_set_state(frame, PG_USER, PG_OWNER_PAGING);
+    dir_set_pte((uintptr_t)dir, virt & ~0xFFF, frame | (flags & 0xFFF) | PTE_PRESENT | PTE_USER);
+}
+
+// Copy the active address space without copying its memory. Every user
+// frame is shared with the clone and gains a reference; writable ones turn
+// read-only + PTE_COW on both sides and are copied by
+// paging_handle_cow_fault on the first write. The cost is one page table
+// per populated user PDE. The identity map and other supervisor-only PDEs
+// are not user memory and are left out.
+uint32_t* paging_clone_directory(void) {
+    uint32_t* clone = paging_create_user_directory();
+    if (!clone) return NULL;
+
+    uint32_t* dst_dir = (uint32_t*)temp_map(TEMP_SLOT_DIR, (uintptr_t)clone);
+    for (uint32_t pd_index = identity_pde_count; pd_index < KERNEL_PDE_FIRST; pd_index++) {
+        uint32_t pde = active_pd[pd_index];
+        if (!(pde & PDE_PRESENT) || !(pde & PDE_USER)) continue;
+
+        // A 4 MB user page is shared as small pages; split it in the parent first
+        if (pde & PDE_LARGE) {
+            paging_split_large(pd_index);
+            pde = active_pd[pd_index];
+        }
+
+        uint32_t* src_pt = get_page_table_virt(pd_index);
+        uint32_t pt_phys = pmm_alloc_zeroed_page();
+        pt_init(pt_phys, 0);
+        uint32_t* dst_pt = (uint32_t*)temp_map(TEMP_SLOT_TABLE, pt_phys);
+        uint32_t copied = 0;
+
+        for (uint32_t pt_index = 0; pt_index < PAGE_ENTRIES; pt_index++) {
+            uint32_t pte = src_pt[pt_index];
+            if (!(pte & PTE_PRESENT)) continue;
+
+            if (frame_is_managed(pte & ~0xFFF)) {
+                pmm_page_get(pte & ~0xFFF);
+                if (pte & PTE_RW) {
+                    pte = (pte & ~PTE_RW) | PTE_COW;
+                    src_pt[pt_index] = pte;
+                }
+            }
+            dst_pt[pt_index] = pte;
+            copied++;
+        }
+
+        temp_unmap(TEMP_SLOT_TABLE);
+        pt_count(pt_phys, copied);
+        dst_dir[pd_index] = pt_phys | (pde & 0xFFF);
+    }
+    temp_unmap(TEMP_SLOT_DIR);
+
+    // The parent's writable user entries just became read-only. They are
+    // never global, so a CR3 reload drops them.
+    flush_tlb_all();
+    return clone;
+}
+
+// Resolve a write fault on a copy-on-write page of the active directory.
+// The last sharer takes the frame back as writable; any other gets a
+// private copy. Returns 0 if virt is not a COW page.
+int paging_handle_cow_fault(uintptr_t virt) {
+    uint32_t pd_index = (virt >> 22) & 0x3FF;
+    uint32_t pt_index = (virt >> 12) & 0x3FF;
+
+    uint32_t pde = active_pd[pd_index];
+    if (!(pde & PDE_PRESENT) || (pde & PDE_LARGE)) return 0;
+
+    uint32_t* pt = get_page_table_virt(pd_index);
+    uint32_t pte = pt[pt_index];
+    if (!(pte & PTE_PRESENT) || !(pte & PTE_COW)) return 0;
+
+    uintptr_t page = virt & ~0xFFF;
+    uintptr_t old = pte & ~0xFFF;
+    uint32_t flags = (pte & 0xFFF & ~PTE_COW) | PTE_RW;
+
+    struct page* desc = pmm_phys_to_page(old);
+    if (desc && desc->refcount > 1) {
+        uintptr_t copy = pmm_alloc_page();
+        pmm_page_set_state(copy, desc->flags & ~PG_PINNED, desc->owner);
+        copy_page(temp_map(TEMP_SLOT_FRAME, copy), (void*)page);
+        temp_unmap(TEMP_SLOT_FRAME);
+
+        pt[pt_index] = copy | flags;
+        pmm_free_page(old);
+    } else {
+        pt[pt_index] = old | flags;
+    }
+
+    __asm__ volatile("invlpg (%0)" ::"r"(page) : "memory");
+    return 1;
+}
+
+// Rewrite the flags of the present pages in [virt, virt + count pages) of
+// the active directory, keeping their frames. Used to drop write access
+// once a loader has filled a page.
+void paging_protect_range(uintptr_t virt, uint32_t count, uint32_t flags) {
+    struct tlb_batch batch;
+    batch.count = 0;
+    batch.global = 0;
+
+    for (uint32_t i = 0; i < count; i++, virt += PAGE_SIZE) {
+        uint32_t pd_index = (virt >> 22) & 0x3FF;
+        if (!(active_pd[pd_index] & PDE_PRESENT)) continue;
+
+        uint32_t* pt = paging_get_table(pd_index);
+        uint32_t pte = pt[(virt >> 12) & 0x3FF];
+        if (!(pte & PTE_PRESENT)) continue;
+
+        pt[(virt >> 12) & 0x3FF] = (pte & ~0xFFF) | (flags & 0xFFF & ~PDE_LARGE) | PTE_PRESENT |
+                                   kernel_global(virt);
+        tlb_batch_add(&batch, virt, pte);
+    }
+
+    tlb_batch_flush(&batch);
+}
+
+// Release every user frame and page table of dir, then dir itself. The
+// shared kernel and identity-map tables are left alone.
+void paging_destroy_directory(uint32_t* dir) {
+    uintptr_t dir_phys = (uintptr_t)dir;
+    if (dir_phys == current_dir || dir_phys == address_spaces[0]) {
+        panic("paging_destroy_directory: directory is in use");
+    }
+
+    uint32_t* pd = (uint32_t*)temp_map(TEMP_SLOT_DIR, dir_phys);
+    for (uint32_t pd_index = identity_pde_count; pd_index < KERNEL_PDE_FIRST; pd_index++) {
+        uint32_t pde = pd[pd_index];
+        if (!(pde & PDE_PRESENT)) continue;
+
+        if (pde & PDE_LARGE) {
+            for (uint32_t i = 0; i < PAGE_ENTRIES; i++) {
+                uintptr_t frame = (pde & ~LARGE_PAGE_MASK) + i * PAGE_SIZE;
+                if (frame_is_managed(frame)) pmm_free_page(frame);
+            }
+            continue;
+        }
+
+        uint32_t* pt = (uint32_t*)temp_map(TEMP_SLOT_TABLE, pde & ~0xFFF);
+        for (uint32_t i = 0; i < PAGE_ENTRIES; i++) {
+            if ((pt[i] & PTE_PRESENT) && frame_is_managed(pt[i] & ~0xFFF)) {
+                pmm_free_page(pt[i] & ~0xFFF);
+            }
+        }
+        temp_unmap(TEMP_SLOT_TABLE);
+        pmm_free_page(pde & ~0xFFF);
+    }
+    temp_unmap(TEMP_SLOT_DIR);
+
+    address_space_remove(dir_phys);
+    pmm_free_page(dir_phys);
+}
+
+// Load dir into CR3. Global kernel entries stay in the TLB.
+void paging_switch_dir(uint32_t* dir) {
+    uintptr_t dir_phys = (uintptr_t)dir;
+    if (dir_phys == current_dir) return;
+
+    current_dir = dir_phys;
+    __asm__ volatile("mov %0, %%cr3" ::"r"(dir_phys) : "memory");
+}
+
+uint32_t* paging_current_directory(void) {
+    return (uint32_t*)current_dir;
 }
 
 
@@ -192,20 +861,39 @@ uintptr_t paging_init(uintptr_t identity_map_end) {
    uint32_t temp_pages = identity_map_end / PAGE_SIZE;
     uint32_t tables_needed = (temp_pages + PAGE_ENTRIES - 1) / PAGE_ENTRIES;
 
+    // With PSE the identity map is made of 4 MB PDEs and needs no tables
+    int large = paging_enable_pse();
+    if (large) tables_needed = 0;
+
 
     // Allocate page tables and directory after the identity-mapped region
     uintptr_t page_tables_start = identity_map_end;
     uintptr_t page_directory_start = page_tables_start + tables_needed * PAGE_SIZE;
     uintptr_t final_end = page_directory_start + PAGE_SIZE;
+    identity_pde_count = (final_end + PAGE_LARGE_SIZE - 1) / PAGE_LARGE_SIZE;
 
     uint32_t total_pages = final_end / PAGE_SIZE;
 
 
     page_tables = (uint32_t*)page_tables_start;
     page_directory = (uint32_t*)page_directory_start;
+    active_pd = page_directory;
+
+    current_dir = page_directory_start;
+    address_spaces[0] = current_dir;
+    address_space_count = 1;
 
     memset(page_tables, 0, tables_needed * PAGE_SIZE);
     memset(page_directory, 0, PAGE_SIZE);
+
+    if (large) {
+        uint32_t large_pages = (final_end + PAGE_LARGE_SIZE - 1) / PAGE_LARGE_SIZE;
+        for (uint32_t i = 0; i < large_pages; i++) {
+            page_directory[i] = (i * PAGE_LARGE_SIZE) | PDE_PRESENT | PDE_RW | PDE_LARGE;
+        }
+        total_pages = 0;
+    }
+
     // Identity map all pages up to final_end
     for (uint32_t page_idx = 0; page_idx < total_pages; page_idx++) {
         uint32_t table_idx = page_idx / PAGE_ENTRIES;
@@ -237,6 +925,19 @@ uintptr_t paging_init(uintptr_t identity_map_end) {
         : "r"(page_directory)
         : "eax"
     );
+
+    active_pd = PD_VIRT;
+
+    // Kernel-half mappings made from here on are tagged global
+    paging_enable_pge();
+
+    // CR0.WP: supervisor writes honour read-only PTEs, so the kernel
+    // cannot write through a copy-on-write share
+    __asm__ volatile(
+        "mov %%cr0, %%eax\n"
+        "or $0x10000, %%eax\n"
+        "mov %%eax, %%cr0\n"
+        ::: "eax", "memory");
     
   uintptr_t phys = page_directory_start;
    uint32_t dir_idx = phys >> 22;
@@ -262,12 +963,7 @@ __asm__ __volatile__ (
 
 
 void paging_run_tests() {
-
-     
-
-  write_serial_string("Page directory first entry: 0x");
-serial_write_hex32(((uint32_t*)0x3A547000)[0]);
-write_serial_string("\n");
+    write_serial_string("Running paging tests...\n");
 
     // Step 1: Allocate a physical page
     uintptr_t phys_addr = (uintptr_t)pmm_alloc_page();
@@ -286,6 +982,19 @@ write_serial_string("\n");
     serial_write_hex32((uint32_t)phys_addr);
     write_serial_string("\n");
 
+    // Only kernel-half entries are global once PGE is on
+    uint32_t* step_pt = get_page_table_virt((test_virt >> 22) & 0x3FF);
+    if (step_pt[(test_virt >> 12) & 0x3FF] & PTE_GLOBAL) {
+        panic("Test failed: user mapping is global");
+    }
+    if (pge_enabled) {
+        temp_map(TEMP_SLOT_FRAME, phys_addr);
+        uint32_t* temp_pt = get_page_table_virt(TEMP_MAP_ADDR >> 22);
+        uint32_t temp_pte = temp_pt[((TEMP_MAP_ADDR >> 12) & 0x3FF) + TEMP_SLOT_FRAME];
+        temp_unmap(TEMP_SLOT_FRAME);
+        if (!(temp_pte & PTE_GLOBAL)) panic("Test failed: kernel-half mapping is not global");
+    }
+
     // Step 3: Write and verify
     volatile uint32_t* test_ptr = (uint32_t*)test_virt;
     *test_ptr = 0x12345678;
@@ -301,6 +1010,110 @@ write_serial_string("\n");
     serial_write_hex32((uint32_t)test_virt);
     write_serial_string("\n");
 
+    // Step 5: Range map across a page table boundary
+    uintptr_t frames[4];
+    for (int i = 0; i < 4; i++) {
+        frames[i] = pmm_alloc_page();
+    }
+    uintptr_t range_virt = test_virt + 0x400000 - 2 * PAGE_SIZE;
+    paging_map_range_list(range_virt, frames, 4, PTE_RW);
+
+    for (int i = 0; i < 4; i++) {
+        volatile uint32_t* p = (uint32_t*)(range_virt + i * PAGE_SIZE);
+        *p = 0xA5A50000 | i;
+    }
+    for (int i = 0; i < 4; i++) {
+        if (*(volatile uint32_t*)(range_virt + i * PAGE_SIZE) != (0xA5A50000 | (uint32_t)i)) {
+            panic("Test failed: range mapping mismatch");
+        }
+    }
+
+    // Both page tables the range touched empty out and are freed with it
+    uint32_t free_before = pmm_get_free_page_count();
+    paging_unmap_range(range_virt, 4);
+    if (pmm_get_free_page_count() != free_before + 4 + 2) {
+        panic("Test failed: paging_unmap_range did not release frames");
+    }
+
+    // Step 6: With PSE the boot identity map is made of 4 MB pages. A 4 MB
+    // aligned contiguous range becomes one large page too, and unmapping a
+    // page inside it splits the PDE.
+    if (pse_enabled && !(active_pd[0] & PDE_LARGE)) {
+        panic("Test failed: identity map does not use 4 MB pages");
+    }
+    uintptr_t block = pmm_alloc_pages(PMM_MAX_ORDER);
+    if (pse_enabled && block && !(block & LARGE_PAGE_MASK)) {
+        uintptr_t large_virt = test_virt + 2 * PAGE_LARGE_SIZE;
+        uint32_t pd_index = (large_virt >> 22) & 0x3FF;
+
+        paging_map_range(large_virt, block, PAGE_ENTRIES, PTE_RW);
+        if (!(active_pd[pd_index] & PDE_LARGE)) {
+            panic("Test failed: aligned range was not mapped with a 4 MB page");
+        }
+        *(volatile uint32_t*)(large_virt + 5 * PAGE_SIZE) = 0x5A5A5A5A;
+
+        paging_unmap_page(large_virt);
+        if (active_pd[pd_index] & PDE_LARGE) {
+            panic("Test failed: partial unmap did not split the 4 MB page");
+        }
+        if (*(volatile uint32_t*)(large_virt + 5 * PAGE_SIZE) != 0x5A5A5A5A) {
+            panic("Test failed: split 4 MB page lost its contents");
+        }
+        paging_unmap_range(large_virt, PAGE_ENTRIES);
+    } else if (block) {
+        pmm_free_pages(block, PMM_MAX_ORDER);
+    }
+
+    // Step 7: Address spaces share the kernel half and the identity map,
+    // and clone the user half
+    uint32_t* boot_dir = paging_current_directory();
+    uint32_t identity_pde = active_pd[0];
+    uint32_t* dir = paging_create_user_directory();
+    if (!dir) panic("Test failed: paging_create_user_directory");
+    paging_map_user(dir, test_virt, PAGE_RW);
+
+    paging_switch_dir(dir);
+    if (active_pd[0] != identity_pde || (active_pd[0] & PDE_USER)) {
+        panic("Test failed: new directory does not share the identity map");
+    }
+    // The PMM's metadata is only reachable through the identity map
+    pmm_free_page(pmm_alloc_page());
+    *(volatile uint32_t*)test_virt = 0xC0FFEE;
+    uint32_t* clone = paging_clone_directory();
+    if (!clone) panic("Test failed: paging_clone_directory");
+    if (active_pd[0] != identity_pde) {
+        panic("Test failed: clone rewrote the identity map in the parent");
+    }
+
+    // The clone shares the frame until the parent writes to it
+    uint32_t* test_pt = get_page_table_virt((test_virt >> 22) & 0x3FF);
+    uintptr_t shared = test_pt[(test_virt >> 12) & 0x3FF] & ~0xFFF;
+    if (pmm_phys_to_page(shared)->refcount != 2) {
+        panic("Test failed: clone did not share the user frame");
+    }
+    *(volatile uint32_t*)test_virt = 0xBADF00D;
+    if ((test_pt[(test_virt >> 12) & 0x3FF] & ~0xFFF) == shared ||
+        pmm_phys_to_page(shared)->refcount != 1) {
+        panic("Test failed: write did not break the COW share");
+    }
+
+    paging_switch_dir(clone);
+    if (active_pd[0] != identity_pde) {
+        panic("Test failed: clone does not share the identity map");
+    }
+    if (*(volatile uint32_t*)test_virt != 0xC0FFEE) {
+        panic("Test failed: clone does not hold its own copy");
+    }
+
+    paging_switch_dir(boot_dir);
+    uint32_t free_before_destroy = pmm_get_free_page_count();
+    paging_destroy_directory(clone);
+    paging_destroy_directory(dir);
+    // Each directory frees its PD, one page table and one frame
+    if (pmm_get_free_page_count() != free_before_destroy + 6) {
+        panic("Test failed: paging_destroy_directory leaked frames");
+    }
+
     write_serial_string("Paging tests passed.\n");
 }
 
@@ -7,10 +7,18 @@
 
 #define PAGE_SIZE 4096
 #define PAGE_ENTRIES 1024
+#define PAGE_LARGE_SIZE 0x400000          // one PDE with PSE
+#define PAGE_LARGE 0x80                   // paging_map_page flag: map a 4 MB page
+#define PAGE_RX 0x5                       // user, present, read-only (no NX without PAE)
+#define PAGE_RW 0x7                       // user, present, writable
+#define PAGING_MAX_ADDRESS_SPACES 64
 #define TEMP_MAP_ADDR 0xF0000000
 #define RECURSIVE_SLOT 1023               // 0x3FF, last PDE entry for recursion
 #define RECURSIVE_BASE_VADDR 0xFFC00000   // Base address of recursive mapping
 
+#define PAGING_TLB_BATCH_MAX 64           // invalidations a range call can queue
+#define PAGING_TLB_FLUSH_THRESHOLD 32     // above this many, reload CR3 instead of invlpg
+
 
 #define KERNEL_PHYS_WINDOW 0xC0000000
 #define phys_to_virt(p) ((void*)((uintptr_t)(p) + KERNEL_PHYS_WINDOW))
@@ -21,6 +29,26 @@ uintptr_t paging_init(uintptr_t identity_map_end);
 void* phys_map(uintptr_t phys_addr);
 void paging_map_page(uintptr_t virt, uintptr_t phys, uint32_t flags);
 void paging_unmap_page(uintptr_t virtual_addr);
+void paging_zero_frame(uintptr_t phys);
+int paging_enable_pse(void);
+int paging_enable_pge(void);
+void paging_flush_tlb_global(void);
+
+uint32_t* paging_create_user_directory(void);
+uint32_t* paging_clone_directory(void);
+void paging_destroy_directory(uint32_t* dir);
+void paging_map_user(uint32_t* dir, uintptr_t virt, uint32_t flags);
+void paging_switch_dir(uint32_t* dir);
+uint32_t* paging_current_directory(void);
+int paging_handle_cow_fault(uintptr_t virt);
+void paging_protect_range(uintptr_t virt, uint32_t count, uint32_t flags);
+
+void paging_map_range(uintptr_t virt, uintptr_t phys, uint32_t count, uint32_t flags);
+void paging_map_range_list(uintptr_t virt, const uintptr_t* phys_list, uint32_t count, uint32_t flags);
+void paging_unmap_range(uintptr_t virt, uint32_t count);
+uint32_t paging_count_large(uintptr_t virt, uint32_t count);
+uint32_t paging_reclaimed_tables(void);
+void paging_set_tlb_flush_threshold(uint32_t pages);
 
 
 
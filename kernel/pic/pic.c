@@ -8,6 +8,7 @@
 
 #define ICW1_INIT    0x11
 #define ICW4_8086    0x01
+#define PIC_EOI      0x20
 
 void pic_remap(void) {
     const uint8_t offset_master = 0x20; // Master PIC vector offset
@@ -36,4 +37,32 @@ void pic_remap(void) {
     // Restore saved masks
     outb(PIC1_DATA, 0xFF);
     outb(PIC2_DATA, 0xFF);
-}
\ No newline at end of file
+}
+
+void pic_send_eoi(uint8_t irq) {
+    if (irq >= 8) {
+        outb(PIC2_COMMAND, PIC_EOI);
+    }
+    outb(PIC1_COMMAND, PIC_EOI);
+}
+
+void pic_mask(uint8_t irq) {
+    uint16_t port = irq < 8 ? PIC1_DATA : PIC2_DATA;
+    outb(port, inb(port) | (1 << (irq & 7)));
+}
+
+void pic_unmask(uint8_t irq) {
+    uint16_t port = irq < 8 ? PIC1_DATA : PIC2_DATA;
+    outb(port, inb(port) & ~(1 << (irq & 7)));
+
+    // Slave lines only reach the CPU through the cascade on IRQ2
+    if (irq >= 8) {
+        outb(PIC1_DATA, inb(PIC1_DATA) & ~(1 << 2));
+    }
+}
+
+// Mask every line, for when the APICs take over
+void pic_disable(void) {
+    outb(PIC1_DATA, 0xFF);
+    outb(PIC2_DATA, 0xFF);
+}
@@ -0,0 +1,152 @@
+#include "buddy.h"
+#include "../memset.h"
+
+
+static inline int buddy_in_range(struct buddy_area* area, uint32_t pfn) {
+    return pfn - area->base_pfn < area->page_count;   // wraps for pfn below the area
+}
+
+static void list_push(struct buddy_area* area, uint32_t pfn, uint32_t order) {
+    struct page* page = &area->pages[pfn - area->base_pfn];
+
+    page->prev = BUDDY_NONE;
+    page->next = area->free_head[order];
+    if (area->free_head[order] != BUDDY_NONE) {
+        area->pages[area->free_head[order] - area->base_pfn].prev = pfn;
+    }
+    area->free_head[order] = pfn;
+    page->flags |= PG_BUDDY;
+    page->order = order;
+    area->stats.free_blocks[order]++;
+}
+
+static void list_remove(struct buddy_area* area, uint32_t pfn) {
+    struct page* page = &area->pages[pfn - area->base_pfn];
+    uint32_t order = page->order;
+
+    if (page->prev != BUDDY_NONE) area->pages[page->prev - area->base_pfn].next = page->next;
+    else area->free_head[order] = page->next;
+
+    if (page->next != BUDDY_NONE) area->pages[page->next - area->base_pfn].prev = page->prev;
+
+    page->flags &= ~PG_BUDDY;
+    page->order = 0;
+    area->stats.free_blocks[order]--;
+}
+
+static inline int is_free_head(struct buddy_area* area, uint32_t pfn, uint32_t order) {
+    struct page* page = &area->pages[pfn - area->base_pfn];
+    return (page->flags & PG_BUDDY) && page->order == order;
+}
+
+// Head of the free block holding 'pfn' and its order, BUDDY_NONE if the page is not free
+static uint32_t find_free_block(struct buddy_area* area, uint32_t pfn, uint32_t* order) {
+    for (uint32_t k = 0; k <= PMM_MAX_ORDER; k++) {
+        uint32_t head = pfn & ~((1u << k) - 1);
+        if (buddy_in_range(area, head) && is_free_head(area, head, k)) {
+            *order = k;
+            return head;
+        }
+    }
+    return BUDDY_NONE;
+}
+
+
+void buddy_init(struct buddy_area* area, uint32_t first_pfn, size_t pages, struct page* page_array) {
+    area->pages = page_array;
+    area->base_pfn = first_pfn;
+    area->page_count = pages;
+
+    memset(&area->stats, 0, sizeof(area->stats));
+    for (uint32_t k = 0; k <= PMM_MAX_ORDER; k++) {
+        area->free_head[k] = BUDDY_NONE;
+    }
+}
+
+void buddy_add_range(struct buddy_area* area, uint32_t pfn, size_t count) {
+    while (count) {
+        uint32_t k = PMM_MAX_ORDER;
+        while (k && ((pfn & ((1u << k) - 1)) || (1u << k) > count)) k--;
+
+        buddy_free(area, pfn, k);
+        pfn += 1u << k;
+        count -= 1u << k;
+    }
+}
+
+uint32_t buddy_alloc(struct buddy_area* area, uint32_t order) {
+    uint32_t k = order;
+    while (k <= PMM_MAX_ORDER && area->free_head[k] == BUDDY_NONE) k++;
+
+    if (k > PMM_MAX_ORDER) return BUDDY_NONE;
+
+    uint32_t pfn = area->free_head[k];
+    list_remove(area, pfn);
+
+    // Keep the low half, give the high halves back
+    while (k > order) {
+        k--;
+        list_push(area, pfn + (1u << k), k);
+        area->stats.splits++;
+    }
+    return pfn;
+}
+
+void buddy_free(struct buddy_area* area, uint32_t pfn, uint32_t order) {
+    while (order < PMM_MAX_ORDER) {
+        uint32_t buddy = pfn ^ (1u << order);
+        if (!buddy_in_range(area, buddy) || !is_free_head(area, buddy, order)) break;
+
+        list_remove(area, buddy);
+        pfn &= ~(1u << order);
+        order++;
+        area->stats.merges++;
+    }
+    list_push(area, pfn, order);
+}
+
+void buddy_take_page(struct buddy_area* area, uint32_t pfn) {
+    uint32_t k;
+    uint32_t head = find_free_block(area, pfn, &k);
+    if (head == BUDDY_NONE) return;   // not on any free list
+
+    list_remove(area, head);
+
+    // Split down to the single page, returning the halves that do not hold it
+    while (k > 0) {
+        k--;
+        uint32_t half = head + (1u << k);
+        if (pfn >= half) {
+            list_push(area, head, k);
+            head = half;
+        } else {
+            list_push(area, half, k);
+        }
+        area->stats.splits++;
+    }
+}
+
+void buddy_take_range(struct buddy_area* area, uint32_t pfn, size_t count) {
+    uint32_t end = pfn + count;
+    uint32_t lo_start = pfn, hi_end = end;
+    uint32_t p = pfn;
+
+    // Pull every block overlapping the run first, then give back the parts
+    // hanging off either end so they cannot merge into the run.
+    while (p < end) {
+        uint32_t k;
+        uint32_t head = find_free_block(area, p, &k);
+        if (head == BUDDY_NONE) {   // not free, caller passed a used page
+            p++;
+            continue;
+        }
+
+        list_remove(area, head);
+        if (head < lo_start) lo_start = head;
+        if (head + (1u << k) > hi_end) hi_end = head + (1u << k);
+        p = head + (1u << k);
+    }
+
+    buddy_add_range(area, lo_start, pfn - lo_start);
+    buddy_add_range(area, end, hi_end - end);
+}
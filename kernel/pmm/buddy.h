@@ -0,0 +1,47 @@
+#ifndef BUDDY_H
+#define BUDDY_H
+
+#include <stddef.h>
+#include "../stdint.h"
+#include "page.h"
+
+// Largest block is 2^PMM_MAX_ORDER pages (order 10 = 4 MB)
+#define PMM_MAX_ORDER 10
+#define BUDDY_NONE 0xFFFFFFFF
+
+struct pmm_buddy_stats {
+    size_t free_blocks[PMM_MAX_ORDER + 1];   // free blocks currently on each order list
+    size_t alloc_failures[PMM_MAX_ORDER + 1]; // requests of this order that found nothing
+    size_t splits;
+    size_t merges;
+};
+
+// One buddy allocator over a contiguous pfn range. Blocks are aligned on
+// absolute pfns, so an order-10 block is also a 4 MB aligned frame.
+struct buddy_area {
+    struct page* pages;       // free list links and block orders live in struct page
+    uint32_t base_pfn;
+    uint32_t page_count;
+    uint32_t free_head[PMM_MAX_ORDER + 1];
+    struct pmm_buddy_stats stats;
+};
+
+// Set up empty free lists covering pfns [first_pfn, first_pfn + page_count)
+void buddy_init(struct buddy_area* area, uint32_t first_pfn, size_t page_count, struct page* pages);
+
+// Hand a run of free pages to the buddy, split into maximal aligned blocks
+void buddy_add_range(struct buddy_area* area, uint32_t pfn, size_t count);
+
+// Returns the first pfn of a free 2^order block, or BUDDY_NONE
+uint32_t buddy_alloc(struct buddy_area* area, uint32_t order);
+
+// Return a 2^order block, merging with free buddies
+void buddy_free(struct buddy_area* area, uint32_t pfn, uint32_t order);
+
+// Remove one page from whichever free block holds it (used by the bitmap path)
+void buddy_take_page(struct buddy_area* area, uint32_t pfn);
+
+// Remove a run of free pages, splitting the blocks at either end
+void buddy_take_range(struct buddy_area* area, uint32_t pfn, size_t count);
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef PAGE_H
+#define PAGE_H
+
+#include "../stdint.h"
+
+// State flags. A free page has a zero refcount and no flags other than
+// PG_BUDDY, which the first page of each free buddy block carries.
+#define PG_RESERVED   0x01   // firmware, kernel image or PMM metadata
+#define PG_KERNEL     0x02
+#define PG_USER       0x04
+#define PG_PAGETABLE  0x08
+#define PG_PINNED     0x10   // holds a reference, must not be freed or moved
+#define PG_BUDDY      0x20   // heads a free buddy block, 'order' is valid
+
+// Owner tags, free for any subsystem to add to
+#define PG_OWNER_NONE   0
+#define PG_OWNER_BOOT   1
+#define PG_OWNER_PAGING 2
+#define PG_OWNER_VMM    3
+#define PG_OWNER_ZERO_POOL 4
+#define PG_OWNER_SLAB   5
+
+// One per physical frame, indexed by pfn within its PMM region
+struct page {
+    union {
+        uint32_t next;        // buddy free list links (pfns) while PG_BUDDY is set
+        uint32_t pt_entries;  // present PTEs while PG_PAGETABLE is set
+    };
+    uint32_t prev;
+    uint16_t refcount;    // per page, pmm_alloc_pages blocks included
+    uint8_t flags;
+    union {
+        uint8_t owner;    // while allocated
+        uint8_t order;    // while PG_BUDDY is set
+    };
+};
+
+#endif
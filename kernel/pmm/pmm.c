@@ -1,9 +1,26 @@
 #include "pmm.h"
 #include "../alarm/panic.h"
 #include "../consol/serial.h"
+#include "../consol/log.h"
+#include "buddy.h"
+#include "../paging/paging.h"
 
 #define PAGE_SIZE 4096
 
+// Summary levels above the page bitmap. Level 0 is the bitmap itself,
+// a set bit at level n means the 32-bit word it covers at level n-1 is full.
+#define PMM_LEVELS 3
+#define PMM_NO_PAGE ((size_t)-1)
+
+// Every memory map entry, plus the splits at the two zone boundaries
+#define PMM_MAX_REGIONS (32 + 2)
+// Blocks pmm_self_test may take while draining the DMA zone
+#define PMM_SELF_TEST_DRAIN_MAX 128
+// Lower zones keep this fraction of their pages back from fallback allocations
+#define PMM_ZONE_RESERVE_DIVISOR 4
+// Frames above 4 GB cannot be mapped without PAE, so they are not tracked
+#define PMM_PHYS_LIMIT 0x100000000ULL
+
 extern uintptr_t _kernel_end ;
 uint64_t bitmap_phys_start = 0;
 
@@ -13,9 +30,46 @@ uintptr_t bitmap_phys_end = 0;
 
  uint8_t* bitmap = 0;
  size_t bitmap_size = 0;
-static uint64_t memory_start = 0;
-static uint64_t memory_end = 0;
+
+// One descriptor per usable memory map entry, sorted by base. Each has its
+// own bitmap, summary levels and buddy lists, so holes between regions cost
+// no metadata and are never scanned.
+struct pmm_region {
+    uint64_t base;
+    uint64_t end;
+    int zone;               // regions never straddle a zone boundary
+    size_t page_count;
+    size_t free_pages;      // kept exact by bitmap_set/bitmap_clear/bitmap_fill_range
+    size_t next_fit_hint;
+    uint32_t* levels[PMM_LEVELS];
+    size_t level_bits[PMM_LEVELS];
+    size_t level_words[PMM_LEVELS];
+    struct page* pages;     // struct page array, placed after the summary levels
+    struct buddy_area buddy;
+};
+
+// A zone is the run of regions between two zone boundaries. Since regions
+// are sorted, a zone's regions are contiguous in pmm_regions.
+struct pmm_zone {
+    size_t first_region;
+    size_t region_count;
+    size_t page_count;
+    size_t free_pages;
+    size_t watermark;       // fallback allocations stop at this many free pages
+    size_t next_fit_region; // relative to first_region
+};
+
+static struct pmm_region pmm_regions[PMM_MAX_REGIONS];
+static size_t pmm_region_count = 0;
+static struct pmm_zone pmm_zones[PMM_ZONE_COUNT];
+static const uint64_t zone_end[PMM_ZONE_COUNT] = { PMM_ZONE_DMA_END, PMM_ZONE_NORMAL_END, PMM_PHYS_LIMIT };
 static size_t total_pages = 0;
+static size_t free_pages = 0;
+static size_t alloc_failures[PMM_MAX_ORDER + 1];
+
+static uintptr_t zero_pool[PMM_ZERO_POOL_SIZE];
+static size_t zero_pool_count = 0;
+static struct pmm_zero_pool_stats zero_pool_stats;
 
 
 
@@ -24,140 +78,709 @@ static size_t total_pages = 0;
 
 
 
-static inline void bitmap_set(size_t index);
-static inline void bitmap_clear(size_t index);
-static inline int bitmap_test(size_t index);
-static inline uintptr_t page_to_addr(size_t page);
+static inline void bitmap_set(struct pmm_region* r, size_t index);
+static inline void bitmap_clear(struct pmm_region* r, size_t index);
+static inline int bitmap_test(struct pmm_region* r, size_t index);
+static inline uintptr_t page_to_addr(struct pmm_region* r, size_t page);
+static inline uint32_t page_to_pfn(struct pmm_region* r, size_t page);
+static size_t bitmap_find_set(struct pmm_region* r, size_t index);
+static void bitmap_fill_range(struct pmm_region* r, size_t first, size_t count, int used);
+static void pmm_free_range(struct pmm_region* r, uint64_t start, uint64_t end);
+static size_t level_find_clear(struct pmm_region* r, int lvl, size_t bit);
+static struct pmm_region* pmm_region_of(uint64_t phys);
+static void pmm_release_page(struct pmm_region* r, size_t page);
+static void pmm_add_region(uint64_t start, uint64_t end, int zone);
 static void pmm_self_test(void);
 
 
 
 
 void pmm_init(struct mem_region* regions, size_t region_count){
- memory_start = UINT64_MAX;
- memory_end = 0;
+ pmm_region_count = 0;
+ total_pages = 0;
+ free_pages = 0;
+ memset(pmm_zones, 0, sizeof(pmm_zones));
 
+ // Build the sorted, page-aligned descriptor table
  for (size_t i = 0; i< region_count; i++){
     if (regions[i].type != 1) continue;
-    if (regions[i].base_addr < memory_start) memory_start = regions[i].base_addr;
-    if (regions[i].base_addr + regions[i].length > memory_end)
-    memory_end = regions[i].base_addr + regions[i].length;
 
+    uint64_t start = (regions[i].base_addr + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    uint64_t end = (regions[i].base_addr + regions[i].length) & ~(uint64_t)(PAGE_SIZE - 1);
+    if (end > PMM_PHYS_LIMIT) end = PMM_PHYS_LIMIT;
+
+    // Split at the zone boundaries
+    uint64_t zone_start = 0;
+    for (int zone = 0; zone < PMM_ZONE_COUNT; zone++) {
+        uint64_t s = start > zone_start ? start : zone_start;
+        uint64_t e = end < zone_end[zone] ? end : zone_end[zone];
+        if (e > s) pmm_add_region(s, e, zone);
+        zone_start = zone_end[zone];
+    }
  }
 
-    total_pages = (memory_end - memory_start) / PAGE_SIZE;
-    bitmap_size = (total_pages + 7) / 8;
+ for (size_t i = pmm_region_count; i-- > 0;) {
+     struct pmm_zone* z = &pmm_zones[pmm_regions[i].zone];
+     z->first_region = i;
+     z->region_count++;
+     z->page_count += pmm_regions[i].page_count;
+ }
+ for (int zone = 0; zone < PMM_ZONE_HIGH; zone++) {
+     pmm_zones[zone].watermark = pmm_zones[zone].page_count / PMM_ZONE_RESERVE_DIVISOR;
+ }
+
+    // Each level is a whole number of words. All regions' metadata is
+    // stored back to back after the kernel.
+    size_t metadata_size = 0;
+    bitmap_size = 0;
+    for (size_t i = 0; i < pmm_region_count; i++) {
+        struct pmm_region* r = &pmm_regions[i];
+        size_t bits = r->page_count;
+        for (int lvl = 0; lvl < PMM_LEVELS; lvl++) {
+            r->level_bits[lvl] = bits;
+            r->level_words[lvl] = (bits + 31) / 32;
+            metadata_size += r->level_words[lvl] * sizeof(uint32_t);
+            bits = r->level_words[lvl];
+        }
+        bitmap_size += r->level_words[0] * sizeof(uint32_t);
+        metadata_size += r->page_count * sizeof(struct page);
+        total_pages += r->page_count;
+    }
 
     bitmap_phys_start = (_kernel_end + PAGE_SIZE -1) & ~(PAGE_SIZE - 1);
-    bitmap_phys_end = bitmap_phys_start + bitmap_size;
+    bitmap_phys_end = bitmap_phys_start + metadata_size;
     bitmap = (uint8_t*)bitmap_phys_start;
 
-    memset(bitmap, 0xFF, bitmap_size);
+    // Bitmaps start all used, struct pages start zeroed (free, no owner)
+    uint8_t* next_meta = bitmap;
+    for (size_t i = 0; i < pmm_region_count; i++) {
+        struct pmm_region* r = &pmm_regions[i];
+        for (int lvl = 0; lvl < PMM_LEVELS; lvl++) {
+            r->levels[lvl] = (uint32_t*)next_meta;
+            memset(r->levels[lvl], 0xFF, r->level_words[lvl] * sizeof(uint32_t));
+            next_meta += r->level_words[lvl] * sizeof(uint32_t);
+        }
+        r->pages = (struct page*)next_meta;
+        memset(r->pages, 0, r->page_count * sizeof(struct page));
+        next_meta += r->page_count * sizeof(struct page);
+        r->free_pages = 0;
+        r->next_fit_hint = 0;
+    }
 
-    for(size_t i = 0; i < region_count; i++){
-        if (regions[i].type != 1) continue;
+    for(size_t i = 0; i < pmm_region_count; i++){
+        struct pmm_region* r = &pmm_regions[i];
+        uint64_t start = r->base;
+        uint64_t end = r->end;
+        if (start < _kernel_end) start = (_kernel_end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+        // Punch the PMM's own metadata out of the region
+        if (start < bitmap_phys_end && end > bitmap_phys_start) {
+            pmm_free_range(r, start, bitmap_phys_start);
+            pmm_free_range(r, bitmap_phys_end, end);
+        } else {
+            pmm_free_range(r, start, end);
+        }
 
-        uint64_t base = regions[i].base_addr;
-        uint64_t length = regions[i].length;
+    }
 
-        for(uint64_t addr = base; addr < base + length; addr += PAGE_SIZE){
-            if(addr< _kernel_end) continue;
-            if(addr >= bitmap_phys_start && addr < (bitmap_phys_start + bitmap_size))
-            continue;
 
-            size_t page = (addr - memory_start) / PAGE_SIZE;
-            bitmap_clear(page);
-        }
+  // Never hand out physical page 0
+  struct pmm_region* zero = pmm_region_of(0);
+  if (zero) bitmap_set(zero, 0);
+
+  // Give every free run to the region's buddy allocator, and tag the
+  // pages left in use (kernel image, metadata) as reserved
+  for (size_t i = 0; i < pmm_region_count; i++) {
+      struct pmm_region* r = &pmm_regions[i];
+      buddy_init(&r->buddy, page_to_pfn(r, 0), r->page_count, r->pages);
+
+      size_t used = 0;
+      while (used < r->page_count) {
+          size_t run = level_find_clear(r, 0, used);
+          if (run == PMM_NO_PAGE) run = r->page_count;
+
+          for (size_t p = used; p < run; p++) {
+              r->pages[p].refcount = 1;
+              r->pages[p].flags = PG_RESERVED;
+              r->pages[p].owner = PG_OWNER_BOOT;
+          }
+          if (run == r->page_count) break;
+
+          size_t run_end = bitmap_find_set(r, run);
+          buddy_add_range(&r->buddy, page_to_pfn(r, run), run_end - run);
+          used = run_end;
+      }
+  }
+
+#ifdef KERNEL_DEBUG
+  pmm_self_test();
+#endif
+}
 
-    }
- 
 
-  bitmap_set(0);  
+static void pmm_add_region(uint64_t start, uint64_t end, int zone) {
+    if (pmm_region_count == PMM_MAX_REGIONS) return;
 
+    size_t slot = pmm_region_count++;
+    while (slot > 0 && pmm_regions[slot - 1].base > start) {
+        pmm_regions[slot] = pmm_regions[slot - 1];
+        slot--;
+    }
+    pmm_regions[slot].base = start;
+    pmm_regions[slot].end = end;
+    pmm_regions[slot].zone = zone;
+    pmm_regions[slot].page_count = (end - start) / PAGE_SIZE;
+}
 
+// Zone 'zone' may serve 'pages' pages for a request whose preferred zone
+// is 'preferred'. Lower zones only serve fallbacks above their watermark.
+static int zone_usable(int zone, int preferred, size_t pages) {
+    struct pmm_zone* z = &pmm_zones[zone];
+    if (z->free_pages < pages) return 0;
+    if (zone == preferred) return 1;
+    return z->free_pages - pages >= z->watermark;
 }
 
+// Returns 0 when the zone has nothing free (page 0 is never handed out)
+static uintptr_t zone_alloc_page(struct pmm_zone* z) {
+    // Next-fit: resume in the region and at the page after the last
+    // allocation. Regions with nothing free are skipped without a scan.
+    for (size_t n = 0; n < z->region_count; n++) {
+        size_t ri = (z->next_fit_region + n) % z->region_count;
+        struct pmm_region* r = &pmm_regions[z->first_region + ri];
+        if (!r->free_pages) continue;
+
+        size_t i = level_find_clear(r, 0, r->next_fit_hint);
+        if (i == PMM_NO_PAGE) {
+            i = level_find_clear(r, 0, 0);
+        }
 
-uintptr_t pmm_alloc_page(void) {
-    write_serial_string("pmm_alloc_page: start\n");
+        bitmap_set(r, i);
+        buddy_take_page(&r->buddy, page_to_pfn(r, i));
+        r->pages[i].refcount = 1;
+        r->pages[i].flags = PG_KERNEL;
+        r->pages[i].owner = PG_OWNER_NONE;
+        r->next_fit_hint = i + 1;
+        z->next_fit_region = ri;
+
+        uintptr_t addr = page_to_addr(r, i);
+        KLOG_TRACE(PMM, "[pmm] alloc page %x (index %u)\n", (uint32_t)addr, (uint32_t)i);
+        return addr;
+    }
 
-    for (size_t i = 0; i < total_pages; i++) {
-    
-        if (!bitmap_test(i)) {
-            write_serial_string("pmm_alloc_page: found free page index: ");
-            serial_write_hex32((uint32_t)i);
-            write_serial_string("\n");
+    return 0;
+}
+
+// Same search as pmm_alloc_page_zone, but 0 instead of a panic when no
+// allowed zone and no pooled frame can serve it
+static uintptr_t pmm_try_alloc_page_zone(int max_zone) {
+    if (max_zone < 0 || max_zone >= PMM_ZONE_COUNT) max_zone = PMM_ZONE_HIGH;
 
-            bitmap_set(i);
+    // Highest allowed zone first, lower zones only above their watermark
+    for (int zone = max_zone; zone >= 0; zone--) {
+        if (!zone_usable(zone, max_zone, 1)) continue;
+        uintptr_t addr = zone_alloc_page(&pmm_zones[zone]);
+        if (addr) return addr;
+    }
 
-            uintptr_t addr = page_to_addr(i);
-            write_serial_string("pmm_alloc_page: allocated page phys addr: 0x");
-            serial_write_hex32((uint32_t)addr);
-            write_serial_string("\n");
+    // Watermarks are a reserve, not a wall: dip into them before failing
+    for (int zone = max_zone; zone >= 0; zone--) {
+        if (!pmm_zones[zone].free_pages) continue;
+        uintptr_t addr = zone_alloc_page(&pmm_zones[zone]);
+        if (addr) return addr;
+    }
 
-            write_serial_string("pmm_alloc_page: zeroing page memory\n");
-            write_serial_string("pmm_alloc_page: memset done\n");
+    // Last resort before giving up: frames parked in the zeroed pool, as
+    // long as they honour the zone limit
+    for (size_t i = zero_pool_count; i-- > 0;) {
+        uintptr_t addr = zero_pool[i];
+        if (pmm_region_of(addr)->zone > max_zone) continue;
 
-            return addr;
-        }
+        zero_pool[i] = zero_pool[--zero_pool_count];
+        pmm_page_set_state(addr, PG_KERNEL, PG_OWNER_NONE);
+        return addr;
     }
 
-    write_serial_string("pmm_alloc_page: out of memory panic\n");
+    return 0;
+}
+
+uintptr_t pmm_alloc_page_zone(int max_zone) {
+    uintptr_t addr = pmm_try_alloc_page_zone(max_zone);
+    if (addr) return addr;
+
+    KLOG_ERR(PMM, "[pmm] out of physical memory\n");
     panic("PMM: Out of physical memory!");
     return 0;
 }
 
+uintptr_t pmm_alloc_page(void) {
+    return pmm_alloc_page_zone(PMM_ZONE_HIGH);
+}
+
+uintptr_t pmm_try_alloc_page(void) {
+    return pmm_try_alloc_page_zone(PMM_ZONE_HIGH);
+}
+
 
 
 void pmm_free_page(uintptr_t  phys_addr) {
-    if (phys_addr < memory_start || phys_addr >= memory_end) return;
     if (phys_addr % PAGE_SIZE != 0) return;  // Not page aligned
-    size_t page = (phys_addr - memory_start) / PAGE_SIZE;
-  
-   bitmap_clear(page);
+    struct pmm_region* r = pmm_region_of(phys_addr);
+    if (!r) return;
+
+    size_t page = (phys_addr - r->base) / PAGE_SIZE;
+    if (!bitmap_test(r, page)) return;  // Already free
+
+    // Shared frames only lose a reference
+    if (r->pages[page].refcount > 1) {
+        r->pages[page].refcount--;
+        return;
+    }
+    pmm_release_page(r, page);
+}
+
+static void pmm_release_page(struct pmm_region* r, size_t page) {
+    r->pages[page].refcount = 0;
+    r->pages[page].flags = 0;
+    r->pages[page].owner = PG_OWNER_NONE;
+
+   bitmap_clear(r, page);
+   buddy_free(&r->buddy, page_to_pfn(r, page), 0);
+}
+
+struct page* pmm_phys_to_page(uintptr_t phys_addr) {
+    struct pmm_region* r = pmm_region_of(phys_addr);
+    if (!r) return NULL;
+    return &r->pages[(phys_addr - r->base) / PAGE_SIZE];
+}
+
+void pmm_page_get(uintptr_t phys_addr) {
+    struct page* page = pmm_phys_to_page(phys_addr);
+    if (!page || !page->refcount) return;  // Free frames cannot be shared
+    if (page->refcount == UINT16_MAX) panic("PMM: page refcount overflow");
+    page->refcount++;
+}
+
+void pmm_page_set_state(uintptr_t phys_addr, uint8_t flags, uint8_t owner) {
+    struct page* page = pmm_phys_to_page(phys_addr);
+    if (!page || !page->refcount) return;
+    page->flags = (page->flags & PG_PINNED) | flags;
+    page->owner = owner;
+}
+
+void pmm_page_pin(uintptr_t phys_addr) {
+    struct page* page = pmm_phys_to_page(phys_addr);
+    if (!page || !page->refcount || (page->flags & PG_PINNED)) return;
+    pmm_page_get(phys_addr);
+    page->flags |= PG_PINNED;
+}
+
+void pmm_page_unpin(uintptr_t phys_addr) {
+    struct page* page = pmm_phys_to_page(phys_addr);
+    if (!page || !(page->flags & PG_PINNED)) return;
+    page->flags &= ~PG_PINNED;
+    pmm_free_page(phys_addr);
+}
+
+uintptr_t pmm_try_alloc_zeroed_page(void) {
+    if (zero_pool_count) {
+        uintptr_t addr = zero_pool[--zero_pool_count];
+        pmm_page_set_state(addr, PG_KERNEL, PG_OWNER_NONE);
+        zero_pool_stats.hits++;
+        return addr;
+    }
+
+    zero_pool_stats.misses++;
+    uintptr_t addr = pmm_try_alloc_page();
+    if (addr) paging_zero_frame(addr);
+    return addr;
+}
+
+uintptr_t pmm_alloc_zeroed_page(void) {
+    uintptr_t addr = pmm_try_alloc_zeroed_page();
+    if (!addr) {
+        KLOG_ERR(PMM, "[pmm] out of physical memory\n");
+        panic("PMM: Out of physical memory!");
+    }
+    return addr;
+}
+
+int pmm_zero_pool_refill(void) {
+    // Keep the pool from eating the last free frames
+    if (zero_pool_count == PMM_ZERO_POOL_SIZE) return 0;
+    if (free_pages <= PMM_ZERO_POOL_SIZE) return 0;
+
+    uintptr_t addr = pmm_alloc_page();
+    paging_zero_frame(addr);
+    pmm_page_set_state(addr, PG_KERNEL, PG_OWNER_ZERO_POOL);
+
+    zero_pool[zero_pool_count++] = addr;
+    zero_pool_stats.refills++;
+    return 1;
+}
+
+void pmm_get_zero_pool_stats(struct pmm_zero_pool_stats* out) {
+    *out = zero_pool_stats;
+    out->pooled = zero_pool_count;
+}
+
+// Page-aligned [start, end) becomes free, boot time only (the buddy is not built yet)
+static void pmm_free_range(struct pmm_region* r, uint64_t start, uint64_t end) {
+    start = (start + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    end &= ~(uint64_t)(PAGE_SIZE - 1);
+    if (start < r->base) start = r->base;
+    if (end > r->end) end = r->end;
+    if (end <= start) return;
+    bitmap_fill_range(r, (start - r->base) / PAGE_SIZE, (end - start) / PAGE_SIZE, 0);
 }
 
 void pmm_mark_region_used(uintptr_t addr, size_t size) {
-    if (addr < memory_start) addr = memory_start;
-    if (addr + size > memory_end) size = memory_end - addr;
+    uint64_t range_start = addr;
+    uint64_t range_end = (uint64_t)addr + size;
+
+    for (size_t i = 0; i < pmm_region_count; i++) {
+        struct pmm_region* r = &pmm_regions[i];
+        uint64_t start = range_start < r->base ? r->base : range_start;
+        uint64_t end = range_end > r->end ? r->end : range_end;
+        if (end <= start) continue;
+
+        size_t first = (start - r->base) / PAGE_SIZE;
+        size_t last = (end - r->base + PAGE_SIZE - 1) / PAGE_SIZE;
+
+        // Only the runs that are currently free have to leave the buddy
+        size_t run = level_find_clear(r, 0, first);
+        while (run < last) {
+            size_t run_end = bitmap_find_set(r, run);
+            if (run_end > last) run_end = last;
+            buddy_take_range(&r->buddy, page_to_pfn(r, run), run_end - run);
+            for (size_t p = run; p < run_end; p++) {
+                r->pages[p].refcount = 1;
+                r->pages[p].flags = PG_RESERVED;
+                r->pages[p].owner = PG_OWNER_BOOT;
+            }
+            run = level_find_clear(r, 0, run_end);
+        }
 
-    for (uintptr_t a = addr; a < addr + size; a += PAGE_SIZE) {
-        size_t page = (a - memory_start) / PAGE_SIZE;
-        bitmap_set(page);
+        bitmap_fill_range(r, first, last - first, 1);
+    }
+}
+
+
+static uintptr_t zone_alloc_pages(struct pmm_zone* z, uint32_t order) {
+    for (size_t i = 0; i < z->region_count; i++) {
+        struct pmm_region* r = &pmm_regions[z->first_region + i];
+        if (r->free_pages < (1u << order)) continue;
+
+        uint32_t pfn = buddy_alloc(&r->buddy, order);
+        if (pfn == BUDDY_NONE) continue;
+
+        // Every frame carries its own reference, so a block's pages can be
+        // mapped, shared and freed one at a time like any other frame
+        size_t first = pfn - page_to_pfn(r, 0);
+        bitmap_fill_range(r, first, 1u << order, 1);
+        for (size_t p = first; p < first + (1u << order); p++) {
+            r->pages[p].refcount = 1;
+            r->pages[p].flags = PG_KERNEL;
+            r->pages[p].owner = PG_OWNER_NONE;
+        }
+        return page_to_addr(r, first);
+    }
+    return 0;
+}
+
+uintptr_t pmm_alloc_pages_zone(uint32_t order, int max_zone) {
+    if (order > PMM_MAX_ORDER) return 0;
+    if (max_zone < 0 || max_zone >= PMM_ZONE_COUNT) max_zone = PMM_ZONE_HIGH;
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (int zone = max_zone; zone >= 0; zone--) {
+            // First pass honours the watermarks, second pass dips into them
+            if (pass == 0 && !zone_usable(zone, max_zone, 1u << order)) continue;
+            uintptr_t addr = zone_alloc_pages(&pmm_zones[zone], order);
+            if (addr) return addr;
+        }
+    }
+
+    alloc_failures[order]++;
+    return 0;
+}
+
+uintptr_t pmm_alloc_pages(uint32_t order) {
+    return pmm_alloc_pages_zone(order, PMM_ZONE_HIGH);
+}
+
+void pmm_get_zone_stats(int zone, struct pmm_zone_stats* out) {
+    memset(out, 0, sizeof(*out));
+    if (zone < 0 || zone >= PMM_ZONE_COUNT) return;
+
+    out->page_count = pmm_zones[zone].page_count;
+    out->free_pages = pmm_zones[zone].free_pages;
+    out->watermark = pmm_zones[zone].watermark;
+}
+
+void pmm_set_zone_watermark(int zone, size_t pages) {
+    if (zone < 0 || zone >= PMM_ZONE_COUNT) return;
+    pmm_zones[zone].watermark = pages;
+}
+
+void pmm_free_pages(uintptr_t phys_addr, uint32_t order) {
+    if (order > PMM_MAX_ORDER) return;
+    if (phys_addr % (PAGE_SIZE << order) != 0) return;  // Not a block we handed out
+
+    struct pmm_region* r = pmm_region_of(phys_addr);
+    if (!r) return;
+
+    size_t first = (phys_addr - r->base) / PAGE_SIZE;
+    size_t count = 1u << order;
+    if (first + count > r->page_count) return;
+
+    // Refuse the whole block if any page in it is already free
+    if (level_find_clear(r, 0, first) < first + count) return;
+
+    // Some page is still shared: drop one reference from each and let the
+    // unshared ones go back individually
+    for (size_t i = 0; i < count; i++) {
+        if (r->pages[first + i].refcount > 1) {
+            for (size_t j = 0; j < count; j++) {
+                pmm_free_page(phys_addr + j * PAGE_SIZE);
+            }
+            return;
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        r->pages[first + i].refcount = 0;
+        r->pages[first + i].flags = 0;
+        r->pages[first + i].owner = PG_OWNER_NONE;
+    }
+
+    bitmap_fill_range(r, first, count, 0);
+    buddy_free(&r->buddy, page_to_pfn(r, first), order);
+}
+
+size_t pmm_get_free_blocks(uint32_t order) {
+    if (order > PMM_MAX_ORDER) return 0;
+
+    size_t blocks = 0;
+    for (size_t i = 0; i < pmm_region_count; i++) {
+        blocks += pmm_regions[i].buddy.stats.free_blocks[order];
+    }
+    return blocks;
+}
+
+void pmm_get_buddy_stats(struct pmm_buddy_stats* out) {
+    memset(out, 0, sizeof(*out));
+
+    for (size_t i = 0; i < pmm_region_count; i++) {
+        struct pmm_buddy_stats* s = &pmm_regions[i].buddy.stats;
+        for (uint32_t k = 0; k <= PMM_MAX_ORDER; k++) {
+            out->free_blocks[k] += s->free_blocks[k];
+        }
+        out->splits += s->splits;
+        out->merges += s->merges;
+    }
+    for (uint32_t k = 0; k <= PMM_MAX_ORDER; k++) {
+        out->alloc_failures[k] = alloc_failures[k];
     }
 }
 
 
 
 size_t pmm_get_free_page_count(void) {
+    return free_pages;
+}
+
+// Full bitmap walk, only used to cross-check the counter in the self test
+static size_t pmm_count_free_pages(void) {
     size_t count = 0;
-    for (size_t i = 0; i < total_pages; i++) {
-        if (!bitmap_test(i)) {
-            count++;
+    for (size_t i = 0; i < pmm_region_count; i++) {
+        for (size_t page = 0; page < pmm_regions[i].page_count; page++) {
+            if (!bitmap_test(&pmm_regions[i], page)) {
+                count++;
+            }
         }
     }
     return count;
 }
 
 
+// --- Region lookup ---
+
+// Binary search over the sorted descriptors, NULL for holes
+static struct pmm_region* pmm_region_of(uint64_t phys) {
+    size_t lo = 0;
+    size_t hi = pmm_region_count;
+
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        struct pmm_region* r = &pmm_regions[mid];
+        if (phys < r->base) hi = mid;
+        else if (phys >= r->end) lo = mid + 1;
+        else return r;
+    }
+    return NULL;
+}
+
+
 // --- Bitmap helpers ---
-static inline void bitmap_set(size_t index) {
-     if (index >= total_pages) return;  // Ignore out-of-range index
-    bitmap[index / 8] |= (1 << (index % 8));
+
+// Index of the lowest clear bit, word must not be all ones
+static inline uint32_t find_first_zero(uint32_t word) {
+    uint32_t bit;
+    __asm__ ("bsf %1, %0" : "=r"(bit) : "rm"(~word) : "cc");
+    return bit;
+}
+
+// Bitmap word 'word' changed, push its full/not-full state up the summary.
+// Stops as soon as a level's fullness does not change.
+static void summary_update(struct pmm_region* r, size_t word) {
+    for (int lvl = 1; lvl < PMM_LEVELS; lvl++) {
+        uint32_t* parent = &r->levels[lvl][word / 32];
+        uint32_t mask = 1u << (word % 32);
+        int was_full = (*parent == 0xFFFFFFFF);
+
+        if (r->levels[lvl - 1][word] == 0xFFFFFFFF) *parent |= mask;
+        else *parent &= ~mask;
+
+        if ((*parent == 0xFFFFFFFF) == was_full) break;
+        word /= 32;
+    }
+}
+
+// Recompute the summary bits covering bitmap words [first_word, last_word]
+static void summary_update_range(struct pmm_region* r, size_t first_word, size_t last_word) {
+    for (int lvl = 1; lvl < PMM_LEVELS; lvl++) {
+        for (size_t w = first_word; w <= last_word; w++) {
+            uint32_t mask = 1u << (w % 32);
+            if (r->levels[lvl - 1][w] == 0xFFFFFFFF) r->levels[lvl][w / 32] |= mask;
+            else r->levels[lvl][w / 32] &= ~mask;
+        }
+        first_word /= 32;
+        last_word /= 32;
+    }
+}
+
+// First clear bit at or after 'bit' in level 'lvl', or PMM_NO_PAGE.
+// Full words are skipped by asking the level above for its next clear bit.
+static size_t level_find_clear(struct pmm_region* r, int lvl, size_t bit) {
+    while (bit < r->level_bits[lvl]) {
+        size_t w = bit / 32;
+        uint32_t word = r->levels[lvl][w] | ((1u << (bit % 32)) - 1);
+
+        if (word != 0xFFFFFFFF) {
+            return w * 32 + find_first_zero(word);
+        }
+
+        if (lvl + 1 == PMM_LEVELS) {
+            bit = (w + 1) * 32;
+            continue;
+        }
+
+        size_t next = level_find_clear(r, lvl + 1, w + 1);
+        if (next == PMM_NO_PAGE) break;
+        bit = next * 32;
+    }
+    return PMM_NO_PAGE;
+}
+
+static inline void bitmap_set(struct pmm_region* r, size_t index) {
+     if (index >= r->page_count) return;  // Ignore out-of-range index
+    uint32_t* word = &r->levels[0][index / 32];
+    uint32_t mask = 1u << (index % 32);
+    if (*word & mask) return;  // Already used, counter unchanged
+
+    *word |= mask;
+    r->free_pages--;
+    pmm_zones[r->zone].free_pages--;
+    free_pages--;
+    if (*word == 0xFFFFFFFF) summary_update(r, index / 32);
+}
+
+static inline void bitmap_clear(struct pmm_region* r, size_t index) {
+     if (index >= r->page_count) return;  // Ignore out-of-range index
+    uint32_t* word = &r->levels[0][index / 32];
+    uint32_t mask = 1u << (index % 32);
+    if (!(*word & mask)) return;  // Already free, counter unchanged
+
+    int was_full = (*word == 0xFFFFFFFF);
+    *word &= ~mask;
+    r->free_pages++;
+    pmm_zones[r->zone].free_pages++;
+    free_pages++;
+    if (was_full) summary_update(r, index / 32);
+}
+
+static inline uint32_t popcount32(uint32_t v) {
+    v = v - ((v >> 1) & 0x55555555);
+    v = (v & 0x33333333) + ((v >> 2) & 0x33333333);
+    return (((v + (v >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
+}
+
+// Mark pages [first, first + count) used or free. Whole words in the middle
+// take one store each, only the two edge words need masking.
+static void bitmap_fill_range(struct pmm_region* r, size_t first, size_t count, int used) {
+    if (first >= r->page_count) return;
+    if (count > r->page_count - first) count = r->page_count - first;
+    if (!count) return;
+
+    size_t last = first + count - 1;
+    size_t first_word = first / 32;
+    size_t last_word = last / 32;
+    uint32_t* words = r->levels[0];
+    size_t changed = 0;
+
+    for (size_t w = first_word; w <= last_word; w++) {
+        uint32_t mask = 0xFFFFFFFF;
+        if (w == first_word) mask &= 0xFFFFFFFF << (first % 32);
+        if (w == last_word) mask &= 0xFFFFFFFF >> (31 - last % 32);
+
+        if (used) {
+            changed += popcount32(~words[w] & mask);
+            words[w] |= mask;
+        } else {
+            changed += popcount32(words[w] & mask);
+            words[w] &= ~mask;
+        }
+    }
+
+    if (used) {
+        r->free_pages -= changed;
+        pmm_zones[r->zone].free_pages -= changed;
+        free_pages -= changed;
+    } else {
+        r->free_pages += changed;
+        pmm_zones[r->zone].free_pages += changed;
+        free_pages += changed;
+    }
+
+    summary_update_range(r, first_word, last_word);
+}
+
+// First set bit at or after 'index' in the page bitmap, page_count if none
+static size_t bitmap_find_set(struct pmm_region* r, size_t index) {
+    while (index < r->page_count) {
+        uint32_t word = r->levels[0][index / 32] & ~((1u << (index % 32)) - 1);
+        if (word) {
+            uint32_t bit;
+            __asm__ ("bsf %1, %0" : "=r"(bit) : "rm"(word) : "cc");
+            size_t found = (index & ~31) + bit;
+            return found < r->page_count ? found : r->page_count;
+        }
+        index = (index & ~31) + 32;
+    }
+    return r->page_count;
 }
 
-static inline void bitmap_clear(size_t index) {
-     if (index >= total_pages) return;  // Ignore out-of-range index
-    bitmap[index / 8] &= ~(1 << (index % 8));
+static inline int bitmap_test(struct pmm_region* r, size_t index) {
+     if (index >= r->page_count) return 1; // Treat out-of-range as allocated/reserved
+    return (r->levels[0][index / 32] >> (index % 32)) & 1;
 }
 
-static inline int bitmap_test(size_t index) {
-     if (index >= total_pages) return 1; // Treat out-of-range as allocated/reserved
-    return bitmap[index / 8] & (1 << (index % 8));
+static inline uintptr_t page_to_addr(struct pmm_region* r, size_t page) {
+    return (uintptr_t)(r->base + (uint64_t)page * PAGE_SIZE);
 }
 
-static inline uintptr_t page_to_addr(size_t page) {
-    return memory_start + page * PAGE_SIZE;
+static inline uint32_t page_to_pfn(struct pmm_region* r, size_t page) {
+    return (uint32_t)(r->base / PAGE_SIZE) + page;
 }
 
 size_t pmm_get_used_page_count(void) {
@@ -165,7 +788,7 @@ size_t pmm_get_used_page_count(void) {
 }
 
 void pmm_print_total_memory(void) {
-    uint64_t total_bytes = (memory_end - memory_start);
+    uint64_t total_bytes = (uint64_t)total_pages * PAGE_SIZE;
 
 }
 
@@ -185,8 +808,13 @@ void pmm_print_free_memory(void) {
 }
 
 
-static inline void pmm_self_test(void) {
+static void pmm_self_test(void) {
+    write_serial_string("Running PMM self test...\n");
+
     size_t free_before = pmm_get_free_page_count();
+    if (free_before != pmm_count_free_pages()) {
+        panic("PMM self test failed: free page counter does not match bitmap");
+    }
 
     void* page = pmm_alloc_page();
     if (page == NULL) {
@@ -200,8 +828,12 @@ static inline void pmm_self_test(void) {
 
     // Check that the allocated page is marked as used in bitmap
     uintptr_t addr = (uintptr_t)page;
-    size_t page_index = (addr - memory_start) / PAGE_SIZE;
-    if (!bitmap_test(page_index)) {
+    struct pmm_region* r = pmm_region_of(addr);
+    if (!r) {
+        panic("PMM self test failed: allocated page outside every region");
+    }
+    size_t page_index = (addr - r->base) / PAGE_SIZE;
+    if (!bitmap_test(r, page_index)) {
         panic("PMM self test failed: allocated page not marked as used");
     }
 
@@ -212,12 +844,128 @@ static inline void pmm_self_test(void) {
         panic("PMM self test failed: free page count did not restore after free");
     }
 
-    if (bitmap_test(page_index)) {
+    if (bitmap_test(r, page_index)) {
         panic("PMM self test failed: freed page still marked as used");
     }
 
-    // Optional: Test allocating all pages (or some) then freeing
+    // Contiguous allocation must be aligned to its size and fully accounted
+    uintptr_t block = pmm_alloc_pages(2);
+    if (!block || block % (PAGE_SIZE << 2) != 0) {
+        panic("PMM self test failed: order-2 block missing or misaligned");
+    }
+    if (pmm_get_free_page_count() != free_before - 4) {
+        panic("PMM self test failed: order-2 block not marked as used");
+    }
+
+    pmm_free_pages(block, 2);
+    if (pmm_get_free_page_count() != free_before) {
+        panic("PMM self test failed: order-2 block not restored after free");
+    }
+
+    // Every page of a multi-order block is referenced on its own: a shared
+    // tail page outlives the block, and its last reference frees it
+    block = pmm_alloc_pages(3);
+    if (!block) panic("PMM self test failed: order-3 block missing");
+    for (uint32_t i = 0; i < 8; i++) {
+        if (pmm_phys_to_page(block + i * PAGE_SIZE)->refcount != 1) {
+            panic("PMM self test failed: block page without its own reference");
+        }
+    }
+    uintptr_t tail = block + 5 * PAGE_SIZE;
+    pmm_page_get(tail);
+    pmm_free_pages(block, 3);
+    if (pmm_get_free_page_count() != free_before - 1 || pmm_phys_to_page(tail)->refcount != 1) {
+        panic("PMM self test failed: shared tail page freed with its block");
+    }
+    pmm_free_page(tail);
+    if (pmm_get_free_page_count() != free_before) {
+        panic("PMM self test failed: order-3 block not restored after its last page");
+    }
+    if (pmm_phys_to_page(block)->refcount || pmm_phys_to_page(tail)->refcount) {
+        panic("PMM self test failed: freed block pages still referenced");
+    }
+
+    // Double free and re-marking must not move the counters
+    pmm_free_page(addr);
+    pmm_mark_region_used(addr, PAGE_SIZE);
+    pmm_mark_region_used(addr, PAGE_SIZE);
+    if (pmm_get_free_page_count() != free_before - 1 || pmm_get_used_page_count() != total_pages - free_before + 1) {
+        panic("PMM self test failed: counters drifted on double free or re-mark");
+    }
+    pmm_free_page(addr);
+
+    // A shared frame survives until its last reference is dropped
+    uintptr_t shared = pmm_alloc_page();
+    pmm_page_get(shared);
+    pmm_free_page(shared);
+    if (pmm_get_free_page_count() != free_before - 1 || pmm_phys_to_page(shared)->refcount != 1) {
+        panic("PMM self test failed: shared page freed while still referenced");
+    }
+    pmm_free_page(shared);
+    if (pmm_get_free_page_count() != free_before || pmm_phys_to_page(shared)->refcount != 0) {
+        panic("PMM self test failed: shared page not freed on last reference");
+    }
+
+    // Zone-restricted requests must stay below the zone's end
+    if (pmm_zones[PMM_ZONE_DMA].free_pages) {
+        uintptr_t dma = pmm_alloc_page_zone(PMM_ZONE_DMA);
+        if (dma >= PMM_ZONE_DMA_END) {
+            panic("PMM self test failed: DMA zone allocation above 16 MB");
+        }
+        pmm_free_page(dma);
+    }
+
+    // With the DMA zone drained, a DMA request may only take a DMA frame
+    // from the zeroed pool, never a higher one parked on top of it
+    if (pmm_zones[PMM_ZONE_DMA].free_pages && pmm_zones[PMM_ZONE_NORMAL].free_pages &&
+        zero_pool_count + 2 <= PMM_ZERO_POOL_SIZE) {
+        static uintptr_t drained[PMM_SELF_TEST_DRAIN_MAX];
+        static uint8_t drained_order[PMM_SELF_TEST_DRAIN_MAX];
+        size_t drained_count = 0;
+        size_t pool_before = zero_pool_count;
+
+        uintptr_t pooled_dma = pmm_alloc_page_zone(PMM_ZONE_DMA);
+        uintptr_t pooled_high = pmm_alloc_page_zone(PMM_ZONE_NORMAL);
+        if (pmm_region_of(pooled_high)->zone == PMM_ZONE_DMA) {
+            panic("PMM self test failed: NORMAL request served from DMA with NORMAL pages free");
+        }
+        zero_pool[zero_pool_count++] = pooled_dma;
+        zero_pool[zero_pool_count++] = pooled_high;
+
+        for (int order = PMM_MAX_ORDER; order >= 0; order--) {
+            uintptr_t b;
+            while ((b = pmm_alloc_pages_zone(order, PMM_ZONE_DMA))) {
+                if (drained_count == PMM_SELF_TEST_DRAIN_MAX) {
+                    panic("PMM self test failed: DMA zone too fragmented to drain");
+                }
+                drained[drained_count] = b;
+                drained_order[drained_count++] = order;
+            }
+        }
+        if (pmm_zones[PMM_ZONE_DMA].free_pages) {
+            panic("PMM self test failed: DMA zone not drained");
+        }
+
+        uintptr_t dma = pmm_alloc_page_zone(PMM_ZONE_DMA);
+        if (dma != pooled_dma || dma >= PMM_ZONE_DMA_END) {
+            panic("PMM self test failed: exhausted DMA zone served from a higher zone");
+        }
+        if (zero_pool_count != pool_before + 1 || zero_pool[pool_before] != pooled_high) {
+            panic("PMM self test failed: zeroed pool lost its higher frame");
+        }
+
+        zero_pool_count = pool_before;
+        pmm_free_page(pooled_high);
+        pmm_free_page(dma);
+        while (drained_count--) {
+            pmm_free_pages(drained[drained_count], drained_order[drained_count]);
+        }
+        if (pmm_get_free_page_count() != free_before) {
+            panic("PMM self test failed: counters drifted over the DMA drain");
+        }
+    }
 
+    write_serial_string("PMM self test passed.\n");
 }
 
 
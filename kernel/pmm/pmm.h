@@ -5,6 +5,8 @@
 #include "../stdint.h"
 #include "../memory_map.h"
 #include "../memset.h"
+#include "buddy.h"
+#include "page.h"
 
 
 extern uintptr_t bitmap_phys_end;
@@ -16,10 +18,70 @@ void pmm_mark_region_used(uintptr_t addr, size_t size);
 void pmm_init(struct mem_region* regions, size_t region_count);
 
 uintptr_t pmm_alloc_page(void);
+// Like pmm_alloc_page, but returns 0 on exhaustion instead of panicking
+uintptr_t pmm_try_alloc_page(void);
 
+// Drops one reference, the frame is freed when the last one goes
 void pmm_free_page(uintptr_t phys_addr);
 
+// Per-frame descriptors. pmm_alloc_page returns frames with refcount 1.
+struct page* pmm_phys_to_page(uintptr_t phys_addr);
+void pmm_page_get(uintptr_t phys_addr);
+void pmm_page_set_state(uintptr_t phys_addr, uint8_t flags, uint8_t owner);
+void pmm_page_pin(uintptr_t phys_addr);
+void pmm_page_unpin(uintptr_t phys_addr);
+
+// Physically contiguous, naturally aligned 2^order pages. Returns 0 when no block is free.
+// Every page of the block has its own refcount of 1, so pages can also be
+// shared or released one at a time with pmm_page_get and pmm_free_page.
+uintptr_t pmm_alloc_pages(uint32_t order);
+void pmm_free_pages(uintptr_t phys_addr, uint32_t order);
+
+// Zeroed frames. Served from a pool refilled at idle, zeroed on the spot on a miss.
+#define PMM_ZERO_POOL_SIZE 64
+
+struct pmm_zero_pool_stats {
+    size_t hits;
+    size_t misses;
+    size_t refills;
+    size_t pooled;
+};
+
+uintptr_t pmm_alloc_zeroed_page(void);
+// Returns 0 on exhaustion instead of panicking
+uintptr_t pmm_try_alloc_zeroed_page(void);
+// Zero one frame into the pool, returns 0 when there was nothing to do
+int pmm_zero_pool_refill(void);
+void pmm_get_zero_pool_stats(struct pmm_zero_pool_stats* out);
+
+size_t pmm_get_free_blocks(uint32_t order);
+void pmm_get_buddy_stats(struct pmm_buddy_stats* out);
+
+// Physical zones. Plain allocations prefer ZONE_HIGH and fall back to lower
+// zones only while those stay above their watermark.
+#define PMM_ZONE_DMA    0   // below 16 MB, legacy ISA DMA
+#define PMM_ZONE_NORMAL 1   // below PMM_ZONE_NORMAL_END, reachable through KERNEL_PHYS_WINDOW
+#define PMM_ZONE_HIGH   2
+#define PMM_ZONE_COUNT  3
+
+#define PMM_ZONE_DMA_END    0x01000000ULL
+#define PMM_ZONE_NORMAL_END 0x38000000ULL
+
+struct pmm_zone_stats {
+    size_t page_count;
+    size_t free_pages;
+    size_t watermark;
+};
+
+// Allocate from max_zone or below, e.g. PMM_ZONE_DMA for ISA DMA buffers
+uintptr_t pmm_alloc_page_zone(int max_zone);
+uintptr_t pmm_alloc_pages_zone(uint32_t order, int max_zone);
+void pmm_get_zone_stats(int zone, struct pmm_zone_stats* out);
+void pmm_set_zone_watermark(int zone, size_t pages);
+
+// O(1), maintained on every alloc/free/mark
 size_t pmm_get_free_page_count(void);
+size_t pmm_get_used_page_count(void);
 void pmm_print_total_memory(void);
 void pmm_print_free_memory(void);
 
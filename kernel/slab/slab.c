@@ -0,0 +1,206 @@
+#include "slab.h"
+#include "../paging/paging.h"
+#include "../pmm/pmm.h"
+#include "../consol/serial.h"
+#include "../consol/log.h"
+#include "../trace/trace.h"
+#include "../alarm/panic.h"
+#include "../memset.h"
+
+
+#define SLAB_OBJ_ALIGN 8
+#define SLAB_PAGE_FLAGS 0x3               // present | writable, supervisor only
+
+// Lives at the start of every slab page. Objects follow it and, while
+// free, hold the link to the next free object in their first word.
+struct slab {
+    struct slab* next;
+    struct slab* prev;
+    struct slab_cache* cache;
+    void* free;
+    uint32_t inuse;
+};
+
+#define SLAB_HEADER_SIZE ((sizeof(struct slab) + SLAB_OBJ_ALIGN - 1) & ~(SLAB_OBJ_ALIGN - 1))
+
+// One bit per arena page, set while a slab is mapped there
+static uint32_t arena_map[SLAB_ARENA_PAGES / 32];
+static uint32_t arena_hint = 0;
+
+
+static uintptr_t arena_take(void) {
+    const uint32_t words = SLAB_ARENA_PAGES / 32;
+
+    for (uint32_t n = 0; n < words; n++) {
+        uint32_t w = (arena_hint + n) % words;
+        if (arena_map[w] == 0xFFFFFFFF) continue;
+
+        uint32_t bit;
+        __asm__ ("bsf %1, %0" : "=r"(bit) : "rm"(~arena_map[w]) : "cc");
+        arena_map[w] |= 1u << bit;
+        arena_hint = w;
+        return SLAB_ARENA_START + (w * 32 + bit) * PAGE_SIZE;
+    }
+    return 0;
+}
+
+static void arena_release(uintptr_t virt) {
+    uint32_t page = (virt - SLAB_ARENA_START) / PAGE_SIZE;
+    arena_map[page / 32] &= ~(1u << (page % 32));
+}
+
+static void slab_list_push(struct slab** head, struct slab* s) {
+    s->prev = NULL;
+    s->next = *head;
+    if (*head) (*head)->prev = s;
+    *head = s;
+}
+
+static void slab_list_remove(struct slab** head, struct slab* s) {
+    if (s->prev) s->prev->next = s->next;
+    else *head = s->next;
+    if (s->next) s->next->prev = s->prev;
+    s->next = s->prev = NULL;
+}
+
+// Map one more page for cache and thread all its objects onto a free list
+static struct slab* slab_grow(struct slab_cache* cache) {
+    uintptr_t virt = arena_take();
+    if (!virt) {
+        KLOG_ERR(SLAB, "[slab] Arena exhausted\n");
+        return NULL;
+    }
+
+    uintptr_t phys = pmm_try_alloc_page();
+    if (!phys) {
+        KLOG_ERR(SLAB, "[slab] Out of physical pages\n");
+        arena_release(virt);
+        return NULL;
+    }
+    pmm_page_set_state(phys, PG_KERNEL, PG_OWNER_SLAB);
+    paging_map_range(virt, phys, 1, SLAB_PAGE_FLAGS);
+
+    struct slab* s = (struct slab*)virt;
+    s->cache = cache;
+    s->inuse = 0;
+    s->next = s->prev = NULL;
+
+    uint8_t* obj = (uint8_t*)virt + SLAB_HEADER_SIZE;
+    s->free = obj;
+    for (uint32_t i = 0; i + 1 < cache->objs_per_slab; i++) {
+        *(void**)obj = obj + cache->obj_size;
+        obj += cache->obj_size;
+    }
+    *(void**)obj = NULL;
+
+    cache->stats.slabs++;
+    cache->stats.grows++;
+    TRACE2(SLAB_GROW, cache, virt);
+    return s;
+}
+
+// Unmap an empty slab; paging_unmap_range hands the frame back to the PMM
+static void slab_release(struct slab_cache* cache, struct slab* s) {
+    uintptr_t virt = (uintptr_t)s;
+    paging_unmap_range(virt, 1);
+    arena_release(virt);
+
+    cache->stats.slabs--;
+    cache->stats.shrinks++;
+}
+
+
+void slab_cache_init(struct slab_cache* cache, const char* name, uint32_t obj_size) {
+    if (obj_size < sizeof(void*)) obj_size = sizeof(void*);
+    obj_size = (obj_size + SLAB_OBJ_ALIGN - 1) & ~(SLAB_OBJ_ALIGN - 1);
+    if (obj_size > PAGE_SIZE - SLAB_HEADER_SIZE) {
+        panic("slab_cache_init: object does not fit in a slab");
+    }
+
+    cache->name = name;
+    cache->obj_size = obj_size;
+    cache->objs_per_slab = (PAGE_SIZE - SLAB_HEADER_SIZE) / obj_size;
+    cache->partial = NULL;
+    cache->full = NULL;
+    cache->empty = NULL;
+    cache->empty_count = 0;
+    memset(&cache->stats, 0, sizeof(cache->stats));
+    cache->stats.objects_per_slab = cache->objs_per_slab;
+}
+
+void* slab_alloc(struct slab_cache* cache) {
+    struct slab* s = cache->partial;
+
+    if (!s) {
+        if (cache->empty) {
+            s = cache->empty;
+            slab_list_remove(&cache->empty, s);
+            cache->empty_count--;
+        } else {
+            s = slab_grow(cache);
+            if (!s) {
+                cache->stats.failures++;
+                return NULL;
+            }
+        }
+        slab_list_push(&cache->partial, s);
+    }
+
+    void* obj = s->free;
+    s->free = *(void**)obj;
+    s->inuse++;
+
+    if (!s->free) {
+        slab_list_remove(&cache->partial, s);
+        slab_list_push(&cache->full, s);
+    }
+
+    cache->stats.allocs++;
+    cache->stats.objects_in_use++;
+    return obj;
+}
+
+void slab_free(struct slab_cache* cache, void* obj) {
+    if (!obj) return;
+
+    struct slab* s = (struct slab*)((uintptr_t)obj & ~(PAGE_SIZE - 1));
+    if (s->cache != cache) {
+        panic("slab_free: object does not belong to this cache");
+    }
+
+    if (!s->free) {
+        slab_list_remove(&cache->full, s);
+        slab_list_push(&cache->partial, s);
+    }
+
+    *(void**)obj = s->free;
+    s->free = obj;
+    s->inuse--;
+
+    cache->stats.frees++;
+    cache->stats.objects_in_use--;
+
+    // Keep a few empty slabs to absorb churn, give the rest back
+    if (s->inuse == 0) {
+        slab_list_remove(&cache->partial, s);
+        if (cache->empty_count < SLAB_MAX_EMPTY) {
+            slab_list_push(&cache->empty, s);
+            cache->empty_count++;
+        } else {
+            slab_release(cache, s);
+        }
+    }
+}
+
+void slab_get_stats(struct slab_cache* cache, struct slab_cache_stats* out) {
+    *out = cache->stats;
+}
+
+// Cache owning obj, or NULL if obj is not inside the slab arena
+struct slab_cache* slab_cache_of(void* obj) {
+    uintptr_t addr = (uintptr_t)obj;
+    if (addr < SLAB_ARENA_START || addr >= SLAB_ARENA_START + SLAB_ARENA_PAGES * PAGE_SIZE) {
+        return NULL;
+    }
+    return ((struct slab*)(addr & ~(PAGE_SIZE - 1)))->cache;
+}
@@ -0,0 +1,44 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include "../stdint.h"
+#include <stddef.h>
+
+// Object caches for fixed-size kernel objects. Each slab is one page with
+// its header at the start, mapped on demand from a dedicated arena so the
+// cache never depends on the VMM it backs.
+#define SLAB_ARENA_START 0xE0000000       // right after KERNEL_HEAP_END
+#define SLAB_ARENA_PAGES 16384            // 64 MB of slab pages
+#define SLAB_MAX_EMPTY   1                // empty slabs kept per cache before release
+
+struct slab;
+
+struct slab_cache_stats {
+    uint32_t slabs;              // slabs currently mapped
+    uint32_t objects_in_use;
+    uint32_t objects_per_slab;
+    uint32_t allocs;
+    uint32_t frees;
+    uint32_t grows;              // slabs mapped over the cache's lifetime
+    uint32_t shrinks;            // empty slabs handed back
+    uint32_t failures;
+};
+
+struct slab_cache {
+    const char* name;
+    uint32_t obj_size;
+    uint32_t objs_per_slab;
+    struct slab* partial;        // some objects free
+    struct slab* full;           // no objects free
+    struct slab* empty;          // every object free
+    uint32_t empty_count;
+    struct slab_cache_stats stats;
+};
+
+void slab_cache_init(struct slab_cache* cache, const char* name, uint32_t obj_size);
+void* slab_alloc(struct slab_cache* cache);
+void slab_free(struct slab_cache* cache, void* obj);
+void slab_get_stats(struct slab_cache* cache, struct slab_cache_stats* out);
+struct slab_cache* slab_cache_of(void* obj);
+
+#endif
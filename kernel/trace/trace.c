@@ -0,0 +1,146 @@
+#include "trace.h"
+#include "../io/io.h"
+#include "../consol/serial.h"
+#include "../alarm/panic.h"
+#include "../apic/apic.h"
+
+
+// A slot is committed once seq holds its ring index + 1. Writers reserve
+// an index with one atomic add, fill the record, then publish seq, so an
+// interrupt that traces in the middle of another write just takes the
+// next slot. The drain copies a record and keeps it only if seq did not
+// move underneath it.
+struct trace_slot {
+    volatile uint32_t seq;
+    struct trace_record rec;
+};
+
+static struct trace_slot trace_ring[TRACE_RING_SIZE];
+static volatile uint32_t trace_head = 0;     // next index to reserve
+static uint32_t trace_tail = 0;              // next index to drain
+static uint32_t trace_drained = 0;
+static uint32_t trace_dropped = 0;
+static uint32_t trace_dropped_unreported = 0;
+
+// Local APIC id, 0 while the 8259 is in charge. The cached copy, so a
+// trace point costs no MMIO read.
+static inline uint8_t trace_cpu_id(void) {
+    return apic_cpu_id;
+}
+
+__attribute__((noinline))
+void trace_emit(uint16_t event, uint32_t nargs, uint32_t a0, uint32_t a1, uint32_t a2, uint32_t a3) {
+    uint32_t idx = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED);
+    struct trace_slot* slot = &trace_ring[idx & (TRACE_RING_SIZE - 1)];
+
+    // Invalidate first, so a drain racing with the overwrite cannot take a
+    // half-written record as the old one
+    slot->seq = 0;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+
+    slot->rec.tsc = rdtsc();
+    slot->rec.event = event;
+    slot->rec.cpu = trace_cpu_id();
+    slot->rec.nargs = nargs;
+    slot->rec.site = (uint32_t)__builtin_return_address(0);
+    slot->rec.args[0] = a0;
+    slot->rec.args[1] = a1;
+    slot->rec.args[2] = a2;
+    slot->rec.args[3] = a3;
+
+    __atomic_store_n(&slot->seq, idx + 1, __ATOMIC_RELEASE);
+}
+
+static void trace_write_bytes(const void* data, uint32_t len) {
+    const uint8_t* p = data;
+    while (len--) {
+        write_serial((char)*p++);
+    }
+}
+
+uint32_t trace_drain(uint32_t max) {
+    uint32_t head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+
+    // Anything more than a ring behind has been overwritten
+    if (head - trace_tail > TRACE_RING_SIZE) {
+        uint32_t lost = head - trace_tail - TRACE_RING_SIZE;
+        trace_dropped += lost;
+        trace_dropped_unreported += lost;
+        trace_tail = head - TRACE_RING_SIZE;
+    }
+
+    uint32_t avail = head - trace_tail;
+    if (max && avail > max) avail = max;
+    if (avail > 0xFFFF) avail = 0xFFFF;
+
+    // Count the committed prefix first, the frame header needs it up front
+    uint32_t count = 0;
+    while (count < avail) {
+        uint32_t idx = trace_tail + count;
+        if (trace_ring[idx & (TRACE_RING_SIZE - 1)].seq != idx + 1) break;
+        count++;
+    }
+    if (!count && !trace_dropped_unreported) return 0;
+
+    uint16_t header[2] = { (uint16_t)count, (uint16_t)trace_dropped_unreported };
+    trace_write_bytes(TRACE_FRAME_MAGIC, TRACE_FRAME_MAGIC_LEN);
+    trace_write_bytes(header, sizeof(header));
+    trace_dropped_unreported = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t idx = trace_tail + i;
+        struct trace_slot* slot = &trace_ring[idx & (TRACE_RING_SIZE - 1)];
+
+        struct trace_record copy = slot->rec;
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+        if (slot->seq != idx + 1) {
+            // Overwritten while copying: keep the frame length, mark it lost
+            copy.event = 0xFFFF;
+            copy.nargs = 0;
+            trace_dropped++;
+        }
+        trace_write_bytes(&copy, sizeof(copy));
+    }
+
+    trace_tail += count;
+    trace_drained += count;
+    return count;
+}
+
+int trace_pending(void) {
+    return __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE) != trace_tail || trace_dropped_unreported;
+}
+
+void trace_get_stats(struct trace_stats* out) {
+    out->written = trace_head;
+    out->drained = trace_drained;
+    out->dropped = trace_dropped;
+}
+
+
+void trace_run_inline_tests(void) {
+    write_serial_string("Running trace inline tests...\n");
+
+    if (sizeof(struct trace_record) != TRACE_RECORD_SIZE) {
+        panic("trace: record layout does not match the wire format");
+    }
+
+    uint32_t first = trace_head;
+    TRACE2(MARK, 0x1111, 0x2222);
+    TRACE4(MARK, 1, 2, 3, 4);
+
+    struct trace_slot* a = &trace_ring[first & (TRACE_RING_SIZE - 1)];
+    struct trace_slot* b = &trace_ring[(first + 1) & (TRACE_RING_SIZE - 1)];
+    if (a->seq != first + 1 || b->seq != first + 2) panic("trace: records not committed");
+    if (a->rec.nargs != 2 || a->rec.args[1] != 0x2222 || b->rec.args[3] != 4) {
+        panic("trace: record contents wrong");
+    }
+    if (b->rec.tsc < a->rec.tsc) panic("trace: timestamps went backwards");
+
+    write_serial_string("\n");
+    if (trace_drain(0) < 2) panic("trace: drain missed records");
+    write_serial_string("\n");
+    if (trace_tail != trace_head) panic("trace: drain left committed records");
+
+    write_serial_string("trace inline tests passed.\n");
+}
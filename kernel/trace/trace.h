@@ -0,0 +1,44 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "../stdint.h"
+#include "trace_events.h"
+
+#define TRACE_RING_SIZE   1024            // records, must be a power of two
+#define TRACE_DRAIN_BATCH 32              // records per background drain
+
+// One event as it sits in the ring and goes out on the wire
+struct __attribute__((packed)) trace_record {
+    uint64_t tsc;
+    uint16_t event;
+    uint8_t cpu;
+    uint8_t nargs;
+    uint32_t site;                        // return address into the caller of trace_emit
+    uint32_t args[4];
+};
+
+struct trace_stats {
+    uint32_t written;
+    uint32_t drained;
+    uint32_t dropped;                     // overwritten before they were drained
+};
+
+// Record an event: O(1), no locks, safe from interrupt handlers. When the
+// ring is full the oldest records are overwritten.
+void trace_emit(uint16_t event, uint32_t nargs, uint32_t a0, uint32_t a1, uint32_t a2, uint32_t a3);
+
+#define TRACE0(ev)                 trace_emit(TRACE_EV_##ev, 0, 0, 0, 0, 0)
+#define TRACE1(ev, a)              trace_emit(TRACE_EV_##ev, 1, (uint32_t)(a), 0, 0, 0)
+#define TRACE2(ev, a, b)           trace_emit(TRACE_EV_##ev, 2, (uint32_t)(a), (uint32_t)(b), 0, 0)
+#define TRACE3(ev, a, b, c)        trace_emit(TRACE_EV_##ev, 3, (uint32_t)(a), (uint32_t)(b), (uint32_t)(c), 0)
+#define TRACE4(ev, a, b, c, d)     trace_emit(TRACE_EV_##ev, 4, (uint32_t)(a), (uint32_t)(b), (uint32_t)(c), (uint32_t)(d))
+
+// Write up to max committed records (0 = all) to the serial port as one
+// binary batch. Called from the idle loop and on panic; not reentrant.
+uint32_t trace_drain(uint32_t max);
+// Nonzero when records are waiting for trace_drain. Safe with interrupts off.
+int trace_pending(void);
+void trace_get_stats(struct trace_stats* out);
+void trace_run_inline_tests(void);
+
+#endif
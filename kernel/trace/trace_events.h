@@ -0,0 +1,29 @@
+#ifndef TRACE_EVENTS_H
+#define TRACE_EVENTS_H
+
+// Trace event ids. Shared with tools/tracedec.c, so keep it to plain
+// preprocessor definitions. Append new events; the ids are in the stream.
+//   TRACE_EVENT(id, name, arg0, arg1, arg2, arg3)
+#define TRACE_EVENT_LIST(TRACE_EVENT)                                            \
+    TRACE_EVENT(0, MARK,       "arg0",    "arg1",   "arg2",  "arg3")            \
+    TRACE_EVENT(1, PAGE_FAULT, "addr",    "err",    "fixed", "")                \
+    TRACE_EVENT(2, VMM_ALLOC,  "size",    "addr",   "flags", "")                \
+    TRACE_EVENT(3, VMM_FREE,   "addr",    "size",   "",      "")                \
+    TRACE_EVENT(4, PT_RECLAIM, "pd_index", "table", "",      "")                \
+    TRACE_EVENT(5, SLAB_GROW,  "cache",   "slab",   "",      "")
+
+#define TRACE_EVENT_ENUM(id, name, a0, a1, a2, a3) TRACE_EV_##name = id,
+enum trace_event_id {
+    TRACE_EVENT_LIST(TRACE_EVENT_ENUM)
+    TRACE_EV_COUNT
+};
+#undef TRACE_EVENT_ENUM
+
+// Drained stream: each batch is TRACE_FRAME_MAGIC, a 16-bit record count,
+// a 16-bit count of records lost to overwrite since the last batch, then
+// the records, all little endian. Console text may sit between batches.
+#define TRACE_FRAME_MAGIC "\0TRC"
+#define TRACE_FRAME_MAGIC_LEN 4
+#define TRACE_RECORD_SIZE 32
+
+#endif
@@ -20,19 +20,21 @@ void usermode_init(void){
     uint32_t* user_directory = paging_create_user_directory();
 
    
-    paging_map_user(user_directory, USER_CODE_VIRT, PAGE_RX );
+    // Writable until the program is copied in, CR0.WP applies to the kernel too
+    paging_map_user(user_directory, USER_CODE_VIRT, PAGE_RW );
 
     for (uintptr_t i = 0; i < 2 * PAGE_SIZE; i += PAGE_SIZE) {
         paging_map_user(user_directory, USER_STACK_TOP - i, PAGE_RW); 
     }
 
+    // The user pages only exist in the new directory, switch before copying
+      paging_switch_dir(user_directory);
+
     size_t prog_size = _binary_user_program_end - _binary_user_program_start;
     memcpy((void*)USER_CODE_VIRT, _binary_user_program_start, prog_size);
+    paging_protect_range(USER_CODE_VIRT, 1, PAGE_RX);
 
 
-
-      paging_switch_dir(user_directory);
-
        write_serial_string("jumping to usermode ring 3");
 
         enter_user_mode(USER_CODE_VIRT, USER_STACK_TOP);
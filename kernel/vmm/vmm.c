@@ -3,277 +3,635 @@
 #include "vmm.h"
 #include "../pmm/pmm.h"
 #include"../consol/serial.h"
+#include "../consol/log.h"
 #include "../alarm/panic.h"
+#include "../slab/slab.h"
+#include "../io/io.h"
+#include "../trace/trace.h"
 
 
 
 
 typedef struct vmm_region
 {
-    struct vmm_region* next;
+    struct vmm_region* next;     // lazy region list
+    struct vmm_region* left;     // free-space tree, ordered by start
+    struct vmm_region* right;
     uint32_t start;
     uint32_t size;
+    uint32_t flags;              // page flags for lazily backed regions
+    uint32_t max_size;           // largest size in this subtree
+    int32_t height;              // AVL height, leaf = 1
 
  
 } vmm_region_t;
 
-typedef struct {
-    vmm_region_t* free_list;     // freelist of free nodes
-    vmm_region_t* pool_start;    // start of slab virtual address range
-    uint32_t capacity;           // total nodes slab can hold
-    uint32_t used;               // allocated nodes count
-} vmm_region_slab_t;
 
 
-static vmm_region_t* user_space_free_list = NULL;
-static vmm_region_t* kernel_space_free_list = NULL;
+// Free virtual ranges per space, as AVL trees ordered by address. Each
+// node carries the largest size below it, so the lowest-addressed range
+// that fits a request is found in O(log n).
+static vmm_region_t* user_space_free_tree = NULL;
+static vmm_region_t* kernel_space_free_tree = NULL;
 
-static vmm_region_slab_t region_slab = {0};
+// Region nodes come from a growable object cache
+static struct slab_cache region_cache;
+static bool region_cache_ready = false;
+
+// Reserved-but-unbacked ranges from vmm_alloc_lazy, searched by the #PF handler
+static vmm_region_t* lazy_regions = NULL;
+static struct vmm_fault_stats fault_stats = {0};
+
+// Kernel stacks handed out, and freed ones kept mapped for the next caller.
+// Each node covers the guard page plus the stack.
+static vmm_region_t* kernel_stacks = NULL;
+static vmm_region_t* kstack_cache = NULL;
+static uint32_t kstack_cache_count = 0;
+static struct vmm_kstack_stats kstack_stats = {0};
+static struct vmm_huge_stats huge_stats = {0};
+
+// Clear count 32-bit words with string stores, for whole 4 MB chunks
+static inline void zero_words(void* dst, uint32_t count) {
+    __asm__ volatile("rep stosl" : "+D"(dst), "+c"(count) : "a"(0) : "memory");
+}
 
 static inline uint32_t align_up(uint32_t val) {
     return (val + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
 }
 vmm_region_t* vmm_region_alloc() {
-    if (!region_slab.pool_start) vmm_region_slab_init();
+    if (!region_cache_ready) {
+        slab_cache_init(&region_cache, "vmm_region", sizeof(vmm_region_t));
+        region_cache_ready = true;
+    }
 
-   if (!region_slab.free_list) {
-        write_serial_string("[vmm] Alloc failed: Free list empty\n");
+    vmm_region_t* node = slab_alloc(&region_cache);
+    if (!node) {
+        KLOG_ERR(VMM, "[vmm] Alloc failed: region cache could not grow\n");
         return NULL;
     }
 
-    vmm_region_t* node = region_slab.free_list;
-    region_slab.free_list = node->next;
-    region_slab.used++;
-
-
-     write_serial_string("[vmm] Alloc region at: ");
-    serial_write_hex32((uintptr_t)node);
-    write_serial_string(" (used ");
-    serial_write_hex32(region_slab.used);
-    write_serial_string("/");
-    serial_write_hex32(region_slab.capacity);
-    write_serial_string(")\n");
-
     // Zero node contents before use (optional)
     node->start = 0;
     node->size = 0;
+    node->flags = 0;
     node->next = NULL;
+    node->left = NULL;
+    node->right = NULL;
+    node->max_size = 0;
+    node->height = 1;
 
     return node;
 }
 
-void vmm_init() {
-    vmm_region_slab_init(); // Ensure the slab is initialized before allocation
+// Free-space tree helpers
+
+static inline int32_t range_height(vmm_region_t* n) {
+    return n ? n->height : 0;
+}
+
+static inline uint32_t range_max(vmm_region_t* n) {
+    return n ? n->max_size : 0;
+}
+
+static void range_update(vmm_region_t* n) {
+    int32_t hl = range_height(n->left), hr = range_height(n->right);
+    n->height = (hl > hr ? hl : hr) + 1;
+
+    uint32_t m = n->size;
+    if (range_max(n->left) > m) m = range_max(n->left);
+    if (range_max(n->right) > m) m = range_max(n->right);
+    n->max_size = m;
+}
+
+static vmm_region_t* range_rotate_right(vmm_region_t* n) {
+    vmm_region_t* l = n->left;
+    n->left = l->right;
+    l->right = n;
+    range_update(n);
+    range_update(l);
+    return l;
+}
+
+static vmm_region_t* range_rotate_left(vmm_region_t* n) {
+    vmm_region_t* r = n->right;
+    n->right = r->left;
+    r->left = n;
+    range_update(n);
+    range_update(r);
+    return r;
+}
+
+static vmm_region_t* range_balance(vmm_region_t* n) {
+    range_update(n);
+    int32_t bf = range_height(n->left) - range_height(n->right);
+
+    if (bf > 1) {
+        if (range_height(n->left->left) < range_height(n->left->right)) {
+            n->left = range_rotate_left(n->left);
+        }
+        return range_rotate_right(n);
+    }
+    if (bf < -1) {
+        if (range_height(n->right->right) < range_height(n->right->left)) {
+            n->right = range_rotate_right(n->right);
+        }
+        return range_rotate_left(n);
+    }
+    return n;
+}
+
+static vmm_region_t* range_tree_insert(vmm_region_t* root, vmm_region_t* node) {
+    if (!root) {
+        node->left = node->right = NULL;
+        range_update(node);
+        return node;
+    }
+    if (node->start < root->start) {
+        root->left = range_tree_insert(root->left, node);
+    } else {
+        root->right = range_tree_insert(root->right, node);
+    }
+    return range_balance(root);
+}
 
+static vmm_region_t* range_tree_remove_min(vmm_region_t* root, vmm_region_t** min) {
+    if (!root->left) {
+        *min = root;
+        return root->right;
+    }
+    root->left = range_tree_remove_min(root->left, min);
+    return range_balance(root);
+}
+
+// Unlink the node starting at start; the node itself is left to the caller
+static vmm_region_t* range_tree_remove(vmm_region_t* root, uint32_t start) {
+    if (!root) return NULL;
+
+    if (start < root->start) {
+        root->left = range_tree_remove(root->left, start);
+    } else if (start > root->start) {
+        root->right = range_tree_remove(root->right, start);
+    } else {
+        if (!root->left) return root->right;
+        if (!root->right) return root->left;
+
+        vmm_region_t* successor;
+        vmm_region_t* right = range_tree_remove_min(root->right, &successor);
+        successor->left = root->left;
+        successor->right = right;
+        return range_balance(successor);
+    }
+    return range_balance(root);
+}
+
+static inline uint32_t range_fit(vmm_region_t* n, uint32_t size, uint32_t align) {
+    uint32_t aligned = (n->start + align - 1) & ~(align - 1);
+    if (aligned < n->start || aligned - n->start > n->size) return 0;
+    return n->size - (aligned - n->start) >= size;
+}
+
+// Lowest-addressed free range that can hold size bytes at align. Subtrees
+// whose largest range is too small are skipped; without alignment padding
+// the first candidate always fits, so the walk is one root-to-leaf path.
+static vmm_region_t* range_tree_find_fit(vmm_region_t* root, uint32_t size, uint32_t align) {
+    if (!root || root->max_size < size) return NULL;
+
+    vmm_region_t* found = range_tree_find_fit(root->left, size, align);
+    if (found) return found;
+    if (root->size >= size && range_fit(root, size, align)) return root;
+    return range_tree_find_fit(root->right, size, align);
+}
+
+// Closest free ranges below and above addr
+static void range_tree_neighbours(vmm_region_t* root, uint32_t addr,
+                                  vmm_region_t** prev, vmm_region_t** next) {
+    *prev = *next = NULL;
+    while (root) {
+        if (root->start < addr) {
+            *prev = root;
+            root = root->right;
+        } else {
+            *next = root;
+            root = root->left;
+        }
+    }
+}
+
+static uint32_t range_tree_count(vmm_region_t* root) {
+    if (!root) return 0;
+    return 1 + range_tree_count(root->left) + range_tree_count(root->right);
+}
+
+
+void vmm_init() {
     vmm_region_t* user_init = vmm_region_alloc();
     if (!user_init) panic("Failed to allocate initial user region");
 
     user_init->start = USER_VIRT_START;
     user_init->size = USER_VIRT_END - USER_VIRT_START + 1;
-    user_init->next = NULL;
 
     vmm_region_t* kernel_init = vmm_region_alloc();
     if (!kernel_init) panic("Failed to allocate initial kernel region");
 
+    // KERNEL_HEAP_END is exclusive, unlike USER_VIRT_END
     kernel_init->start = KERNEL_HEAP_START;
-    kernel_init->size = KERNEL_HEAP_END - KERNEL_HEAP_START + 1;
-    kernel_init->next = NULL;
+    kernel_init->size = KERNEL_HEAP_END - KERNEL_HEAP_START;
 
-    user_space_free_list = user_init;
-    kernel_space_free_list = kernel_init;
+    user_space_free_tree = range_tree_insert(NULL, user_init);
+    kernel_space_free_tree = range_tree_insert(NULL, kernel_init);
 }
 
 
 
-void vmm_region_slab_init() {
-   if (region_slab.pool_start) {
-        write_serial_string("[vmm_region_slab_init] Slab already initialized\n");
-        return;
-    }
+void vmm_region_free(vmm_region_t* node) {
+    if (!node) return;
+    slab_free(&region_cache, node);
+}
 
-     write_serial_string("[vmm_region_slab_init] Initializing VMM region slab\n");
+// Carve size bytes at align out of the free tree. Eager allocations are
+// backed and mapped here; lazy ones only record the range and its page
+// flags, and vmm_handle_page_fault backs each page on first touch. The
+// first guard pages of an eager range are reserved but never mapped.
+// VMM_ALLOC_HUGE backs each whole 4 MB chunk with one contiguous block
+// and falls back to 4 KB frames for a chunk when none is free.
+// VMM_ALLOC_RESERVE ranges are left for the caller to map.
+static void* vmm_alloc_range(uint32_t size, uint32_t align, bool kernel, uint32_t vmm_flags, uint32_t guard) {
+    bool lazy = vmm_flags & VMM_ALLOC_LAZY;
+    bool reserve = vmm_flags & VMM_ALLOC_RESERVE;
+    bool huge = !lazy && !reserve && (vmm_flags & VMM_ALLOC_HUGE);
 
-    // Allocate and map physical pages for the slab
-    uintptr_t vaddr = VMM_REGION_POOL_VADDR;
-    for (int i = 0; i < VMM_REGION_POOL_PAGES; i++) {
-        void* phys = pmm_alloc_page();
-        if (!phys) panic("Failed to allocate physical page for VMM region slab");
-        uint32_t flags = PAGE_PRESENT | PAGE_WRITE | PAGE_USER;
-               
-        
-        paging_map_page(vaddr + i * PAGE_SIZE, (uintptr_t)phys,flags);
+    KLOG_DEBUG(VMM, "[vmm_alloc] size=%x kernel=%d\n", size, kernel);
 
-        write_serial_string("[vmm] Mapped page ");
-        serial_write_hex32(i);
-        write_serial_string(" -> vaddr: ");
-        serial_write_hex32(vaddr + i * PAGE_SIZE);
-        write_serial_string(" phys: ");
-        serial_write_hex32((uintptr_t)phys);
-        write_serial_string("\n");
-        // flags set to present, writable, user/kernel as needed
+    size = align_up(size);
+    if (!size) return NULL;
+    if (huge && size >= PAGE_LARGE_SIZE && align < PAGE_LARGE_SIZE) align = PAGE_LARGE_SIZE;
+    if (align < PAGE_SIZE) align = PAGE_SIZE;
+    if (align & (align - 1)) return NULL;
+
+    vmm_region_t** tree = kernel ? &kernel_space_free_tree : &user_space_free_tree;
+    vmm_region_t* curr = range_tree_find_fit(*tree, size, align);
+    if (!curr) {
+        KLOG_WARN(VMM, "[vmm_alloc] No suitable region found for %x bytes\n", size);
+        return NULL;
     }
 
-    region_slab.pool_start = (vmm_region_t*)vaddr;
-    region_slab.capacity = (VMM_REGION_POOL_PAGES * PAGE_SIZE) / sizeof(vmm_region_t);
-    region_slab.used = 0;
-
-      write_serial_string("[vmm] Slab pool start: ");
-      serial_write_hex32((uintptr_t)region_slab.pool_start);
-        write_serial_string("\n");
+    uint32_t result = (curr->start + align - 1) & ~(align - 1);
+    uint32_t head = result - curr->start;
+    uint32_t tail = curr->size - head - size;
 
+    // Take every node this needs before touching the tree
+    vmm_region_t* tail_node = NULL;
+    vmm_region_t* lazy_node = NULL;
+    if (head && tail) {
+        tail_node = vmm_region_alloc();
+        if (!tail_node) return NULL;
+    }
+    if (lazy) {
+        lazy_node = vmm_region_alloc();
+        if (!lazy_node) {
+            if (tail_node) vmm_region_free(tail_node);
+            return NULL;
+        }
+    }
 
-    write_serial_string("[vmm] Slab capacity: ");
-    serial_write_hex32(region_slab.capacity);
-    write_serial_string(" regions, region size: ");
-    serial_write_hex32(sizeof(vmm_region_t));
-    write_serial_string("\n");
+    uint32_t flags = PAGE_PRESENT | PAGE_WRITE;
+    if (!kernel) flags |= PAGE_USER;
+
+    // Gather frames a batch at a time and map each batch in one range call
+    uintptr_t frames[VMM_MAP_BATCH];
+    uint32_t pages = size / PAGE_SIZE;
+    uint32_t mapped = guard;
+    while (!lazy && !reserve && mapped < pages) {
+        uintptr_t virt = result + mapped * PAGE_SIZE;
+        if (huge && pages - mapped >= PAGE_ENTRIES && !(virt & (PAGE_LARGE_SIZE - 1))) {
+            uintptr_t block = pmm_alloc_pages(PMM_MAX_ORDER);
+            if (block && !(block & (PAGE_LARGE_SIZE - 1))) {
+                for (uint32_t i = 0; i < PAGE_ENTRIES; i++) {
+                    pmm_page_set_state(block + i * PAGE_SIZE, kernel ? PG_KERNEL : PG_USER, PG_OWNER_VMM);
+                }
+                paging_map_range(virt, block, PAGE_ENTRIES, flags);
+                zero_words((void*)virt, PAGE_LARGE_SIZE / 4);
+                huge_stats.large_pages_in_use += paging_count_large(virt, PAGE_ENTRIES);
+                huge_stats.large_allocs++;
+                mapped += PAGE_ENTRIES;
+                continue;
+            }
+            if (block) pmm_free_pages(block, PMM_MAX_ORDER);
+            huge_stats.fallbacks++;
+        }
 
+        uint32_t batch = pages - mapped;
+        if (batch > VMM_MAP_BATCH) batch = VMM_MAP_BATCH;
+
+        for (uint32_t i = 0; i < batch; i++) {
+            uint32_t phys = (uint32_t)pmm_try_alloc_zeroed_page();
+            if (!phys) {
+                KLOG_WARN(VMM, "[vmm_alloc] out of frames during mapping\n");
+                while (i--) pmm_free_page(frames[i]);
+                // Undo what is mapped so far, 4 MB chunks included
+                uintptr_t done = result + guard * PAGE_SIZE;
+                huge_stats.large_pages_in_use -= paging_count_large(done, mapped - guard);
+                paging_unmap_range(done, mapped - guard);
+                if (tail_node) vmm_region_free(tail_node);
+                return NULL;
+            }
+            pmm_page_set_state(phys, kernel ? PG_KERNEL : PG_USER, PG_OWNER_VMM);
+            frames[i] = phys;
+        }
 
-    // Initialize freelist: chain all nodes in slab as free
-    for (uint32_t i = 0; i < region_slab.capacity - 1; i++) {
-        region_slab.pool_start[i].next = &region_slab.pool_start[i + 1];
+        paging_map_range_list(virt, frames, batch, flags);
+        mapped += batch;
     }
-    region_slab.pool_start[region_slab.capacity - 1].next = NULL;
 
-    region_slab.free_list = region_slab.pool_start;
+    if (lazy) {
+        lazy_node->start = result;
+        lazy_node->size = size;
+        lazy_node->flags = flags;
+        lazy_node->next = lazy_regions;
+        lazy_regions = lazy_node;
+    }
 
-    int count = 0;
-    vmm_region_t* node = region_slab.free_list;
-    while (node) {
-        count++;
-        node = node->next;
+    // Split the free range around the allocation: the head keeps the node,
+    // the tail reuses it when there is no head
+    *tree = range_tree_remove(*tree, curr->start);
+    if (head) {
+        curr->size = head;
+        *tree = range_tree_insert(*tree, curr);
+    } else if (tail) {
+        tail_node = curr;
+    } else {
+        vmm_region_free(curr);
+    }
+    if (tail) {
+        tail_node->start = result + size;
+        tail_node->size = tail;
+        *tree = range_tree_insert(*tree, tail_node);
     }
 
-     write_serial_string("[vmm] Freelist initialized. Region count: ");
-    serial_write_hex32(count);
-    write_serial_string("\n");
+    KLOG_DEBUG(VMM, "[vmm_alloc] -> %x\n", result);
+    TRACE3(VMM_ALLOC, size, result, vmm_flags);
+    return (void*)result;
+}
 
+void* vmm_alloc(uint32_t size, bool kernel) {
+    return vmm_alloc_range(size, PAGE_SIZE, kernel, 0, 0);
+}
 
+// vmm_flags takes VMM_ALLOC_* bits; a lazy range is never huge
+void* vmm_alloc_flags(uint32_t size, bool kernel, uint32_t vmm_flags) {
+    return vmm_alloc_range(size, PAGE_SIZE, kernel, vmm_flags, 0);
 }
 
+void* vmm_alloc_lazy(uint32_t size, bool kernel) {
+    return vmm_alloc_range(size, PAGE_SIZE, kernel, VMM_ALLOC_LAZY, 0);
+}
 
+// Map size bytes of physical memory that the PMM does not own, such as
+// firmware tables or device registers, and return the address of phys.
+// The mapping must never reach vmm_free, which would hand the frames to
+// the PMM; vmm_unmap_phys takes it down.
+void* vmm_map_phys(uintptr_t phys, uint32_t size, uint32_t page_flags) {
+    uintptr_t offset = phys & (PAGE_SIZE - 1);
+    uint32_t bytes = align_up(size + offset);
 
+    uintptr_t virt = (uintptr_t)vmm_alloc_range(bytes, PAGE_SIZE, true, VMM_ALLOC_RESERVE, 0);
+    if (!virt) return NULL;
 
-void vmm_region_free(vmm_region_t* node) {
-    if (!node) return;
+    paging_map_range(virt, phys - offset, bytes / PAGE_SIZE, PAGE_PRESENT | PAGE_WRITE | page_flags);
+    return (void*)(virt + offset);
+}
 
-    // Zero memory (optional)
-    node->start = 0;
-    node->size = 0;
+// Undo vmm_map_phys(phys, size). Each frame the PMM knows about takes an
+// extra reference first, so the one vmm_free drops leaves it as it was.
+void vmm_unmap_phys(void* addr, uintptr_t phys, uint32_t size) {
+    uintptr_t offset = phys & (PAGE_SIZE - 1);
+    uint32_t bytes = align_up(size + offset);
 
-    node->next = region_slab.free_list;
-    region_slab.free_list = node;
-    region_slab.used--;
+    for (uint32_t off = 0; off < bytes; off += PAGE_SIZE) {
+        pmm_page_get(phys - offset + off);
+    }
+    vmm_free((uint8_t*)addr - offset, bytes, true);
 }
 
-void* vmm_alloc(uint32_t size, bool kernel) {
-    write_serial_string("[vmm_alloc] Called with size: ");
-    serial_write_hex32(size);
-    write_serial_string(", kernel: ");
-    write_serial_string(kernel ? "true\n" : "false\n");
+// align must be a power of two; anything below a page means page aligned
+void* vmm_alloc_aligned(uint32_t size, uint32_t align, bool kernel) {
+    return vmm_alloc_range(size, align, kernel, 0, 0);
+}
 
-    size = align_up(size);
-    write_serial_string("[vmm_alloc] Aligned size: ");
-    serial_write_hex32(size);
-    write_serial_string("\n");
+// Hand out a KSTACK_PAGES kernel stack with KSTACK_GUARD_PAGES unmapped
+// below it and return its top. Freed stacks are reused while still
+// mapped, so only a cache miss touches the page tables.
+uintptr_t vmm_alloc_kernel_stack(void) {
+    vmm_region_t* node = kstack_cache;
+    if (node) {
+        kstack_cache = node->next;
+        kstack_cache_count--;
+        kstack_stats.cache_hits++;
+    } else {
+        node = vmm_region_alloc();
+        if (!node) return 0;
+
+        uint32_t span = (KSTACK_GUARD_PAGES + KSTACK_PAGES) * PAGE_SIZE;
+        void* base = vmm_alloc_range(span, PAGE_SIZE, true, 0, KSTACK_GUARD_PAGES);
+        if (!base) {
+            vmm_region_free(node);
+            return 0;
+        }
+        node->start = (uint32_t)base;
+        node->size = span;
+    }
 
-    vmm_region_t** list = kernel ? &kernel_space_free_list : &user_space_free_list;
-    write_serial_string("[vmm_alloc] Using ");
-    write_serial_string(kernel ? "kernel_space_free_list\n" : "user_space_free_list\n");
-
-    vmm_region_t* curr = *list;
-    vmm_region_t* prev = NULL;
-
-    while (curr) {
-        write_serial_string("[vmm_alloc] Inspecting region at ");
-        serial_write_hex32(curr->start);
-        write_serial_string(" size: ");
-        serial_write_hex32(curr->size);
-        write_serial_string("\n");
-
-        if (curr->size >= size) {
-            
-            uint32_t result = curr->start;
-
-            write_serial_string("[vmm_alloc] Found suitable region at ");
-            serial_write_hex32(result);
-            write_serial_string("\n");
-
-            for (uint32_t offset = 0; offset < size; offset += PAGE_SIZE) {
-                uint32_t phys = (uint32_t)pmm_alloc_page();
-                if (!phys) {
-                    write_serial_string("[vmm_alloc] pmm_alloc_page failed during mapping\n");
-                    return NULL;
-                }
-                uint32_t flags = PAGE_PRESENT | PAGE_WRITE;
-                if (!kernel) flags |= PAGE_USER;
-
-                write_serial_string("[paging_map_page] Mapping vaddr ");
-                serial_write_hex32(result + offset);
-                write_serial_string(" to phys ");
-                serial_write_hex32(phys);
-                write_serial_string(" with flags ");
-                serial_write_hex32(flags);
-                write_serial_string("\n");
-
-                paging_map_page(result + offset, phys, flags);
-                write_serial_string("retuned out of pageingmap ");
-
-                // Zero the newly mapped page
-                memset((void*)(result + offset), 0, PAGE_SIZE);
-            }
+    node->next = kernel_stacks;
+    kernel_stacks = node;
+    kstack_stats.allocs++;
+    kstack_stats.live++;
+    return node->start + node->size;
+}
 
-            // Adjust free list region
-            curr->start += size;
-            curr->size -= size;
+void vmm_free_kernel_stack(uintptr_t top) {
+    vmm_region_t** link = &kernel_stacks;
+    while (*link && (*link)->start + (*link)->size != top) {
+        link = &(*link)->next;
+    }
+    if (!*link) {
+        panic("vmm_free_kernel_stack: not a kernel stack");
+    }
 
-            if (curr->size == 0) {
-                write_serial_string("[vmm_alloc] Region fully allocated, removing from free list\n");
-                if (prev)
-                    prev->next = curr->next;
-                else
-                    *list = curr->next;
+    vmm_region_t* node = *link;
+    *link = node->next;
+    kstack_stats.live--;
 
-                vmm_region_free(curr);
-            }
+    if (kstack_cache_count < KSTACK_CACHE_MAX) {
+        node->next = kstack_cache;
+        kstack_cache = node;
+        kstack_cache_count++;
+        return;
+    }
+
+    // The guard page was never mapped; vmm_free skips it
+    vmm_free((void*)node->start, node->size, true);
+    vmm_region_free(node);
+}
+
+// True when addr lies in the guard page of a live or cached kernel stack
+bool vmm_is_stack_guard(uintptr_t addr) {
+    vmm_region_t* lists[2] = { kernel_stacks, kstack_cache };
+    for (int i = 0; i < 2; i++) {
+        for (vmm_region_t* n = lists[i]; n; n = n->next) {
+            if (addr >= n->start && addr - n->start < KSTACK_GUARD_PAGES * PAGE_SIZE) return true;
+        }
+    }
+    return false;
+}
+
+void vmm_get_huge_stats(struct vmm_huge_stats* out) {
+    *out = huge_stats;
+}
+
+void vmm_get_kstack_stats(struct vmm_kstack_stats* out) {
+    *out = kstack_stats;
+    out->cached = kstack_cache_count;
+}
+
+static vmm_region_t* lazy_region_find(uintptr_t addr) {
+    vmm_region_t* region = lazy_regions;
+    while (region && (addr < region->start || addr - region->start >= region->size)) {
+        region = region->next;
+    }
+    return region;
+}
 
-            write_serial_string("[vmm_alloc] Allocation successful at ");
-            serial_write_hex32(result);
-            write_serial_string("\n");
-            return (void*)result;
+// Cut [vaddr, vaddr + size) out of every lazy record it overlaps, so a
+// later fault in the freed part is not backed again. A record that
+// keeps pages on both sides is split in two.
+static void lazy_region_trim(uintptr_t vaddr, uint32_t size) {
+    uintptr_t end = vaddr + size;
+    vmm_region_t** lazy = &lazy_regions;
+    while (*lazy) {
+        vmm_region_t* region = *lazy;
+        uintptr_t region_end = region->start + region->size;
+        if (end <= region->start || vaddr >= region_end) {
+            lazy = &region->next;
+            continue;
         }
 
-        prev = curr;
-        curr = curr->next;
+        if (vaddr <= region->start && end >= region_end) {
+            *lazy = region->next;
+            vmm_region_free(region);
+            continue;
+        }
+
+        if (vaddr > region->start && end < region_end) {
+            vmm_region_t* tail = vmm_region_alloc();
+            if (!tail) {
+                panic("vmm_free: no region node to split a lazy range");
+            }
+            tail->start = end;
+            tail->size = region_end - end;
+            tail->flags = region->flags;
+            tail->next = region->next;
+            region->next = tail;
+            region->size = vaddr - region->start;
+        } else if (vaddr <= region->start) {
+            region->start = end;
+            region->size = region_end - end;
+        } else {
+            region->size = vaddr - region->start;
+        }
+        lazy = &region->next;
+    }
+}
+
+// Back the faulting page of a lazy region with a zeroed frame, or give a
+// copy-on-write page its private copy. Returns 1
+// when the access can be retried, 0 when the fault is a real error. This
+// runs on every first touch, so it stays free of serial output.
+int vmm_handle_page_fault(uintptr_t fault_addr, uint32_t error_code) {
+    uint64_t start = rdtsc();
+
+    // On a present page only a write to a copy-on-write share is resolvable
+    if (error_code & PF_ERR_PRESENT) {
+        if (!(error_code & PF_ERR_WRITE) || !paging_handle_cow_fault(fault_addr)) return 0;
+
+        uint64_t cycles = rdtsc() - start;
+        fault_stats.cow_faults++;
+        fault_stats.total_cycles += cycles;
+        if (cycles > fault_stats.max_cycles) fault_stats.max_cycles = cycles;
+        TRACE3(PAGE_FAULT, fault_addr, error_code, 1);
+        return 1;
     }
 
-    write_serial_string("[vmm_alloc] No suitable region found, allocation failed\n");
-    return NULL;
+    vmm_region_t* region = lazy_region_find(fault_addr);
+    if (!region) return 0;
+    if ((error_code & PF_ERR_USER) && !(region->flags & PAGE_USER)) return 0;
+
+    // Out of memory is an unresolved fault, reported by the caller
+    uintptr_t frame = pmm_try_alloc_zeroed_page();
+    if (!frame) return 0;
+    pmm_page_set_state(frame, (region->flags & PAGE_USER) ? PG_USER : PG_KERNEL, PG_OWNER_VMM);
+    paging_map_range(fault_addr & ~(PAGE_SIZE - 1), frame, 1, region->flags);
+
+    uint64_t cycles = rdtsc() - start;
+    fault_stats.minor_faults++;
+    fault_stats.total_cycles += cycles;
+    if (cycles > fault_stats.max_cycles) fault_stats.max_cycles = cycles;
+    TRACE3(PAGE_FAULT, fault_addr, error_code, 1);
+    return 1;
+}
+
+void vmm_get_fault_stats(struct vmm_fault_stats* out) {
+    *out = fault_stats;
 }
 
 
 void vmm_free(void* addr, uint32_t size, bool kernel) {
     size = align_up(size);
     uintptr_t vaddr = (uintptr_t)addr;
+    TRACE2(VMM_FREE, vaddr, size);
 
-    // Unmap all pages
-    for (uint32_t offset = 0; offset < size; offset += PAGE_SIZE) {
-        paging_unmap_page(vaddr + offset);
-    }
+    // Unmap all pages with a single TLB flush. Untouched lazy pages are
+    // simply not present and get skipped.
+    huge_stats.large_pages_in_use -= paging_count_large(vaddr, size / PAGE_SIZE);
+    paging_unmap_range(vaddr, size / PAGE_SIZE);
 
-     // Allocate tracking node from slab
-    vmm_region_t* node = vmm_region_alloc();
-    if (!node) {
-        panic("Out of VMM region slab nodes");
-    }
+    lazy_region_trim(vaddr, size);
 
+    // Give the range back, merging with the free ranges on either side
+    vmm_region_t** tree = kernel ? &kernel_space_free_tree : &user_space_free_tree;
+    vmm_region_t* prev;
+    vmm_region_t* next;
+    range_tree_neighbours(*tree, vaddr, &prev, &next);
 
-    node->start = vaddr;
-    node->size = size;
-
-    vmm_region_t** list = kernel ? &kernel_space_free_list : &user_space_free_list;
-    node->next = *list;
-    *list = node;
+    if ((prev && prev->start + prev->size > vaddr) || (next && vaddr + size > next->start)) {
+        panic("vmm_free: range overlaps free space");
+    }
+    bool merge_prev = prev && prev->start + prev->size == vaddr;
+    bool merge_next = next && vaddr + size == next->start;
+
+    if (merge_prev && merge_next) {
+        *tree = range_tree_remove(*tree, next->start);
+        *tree = range_tree_remove(*tree, prev->start);
+        prev->size += size + next->size;
+        *tree = range_tree_insert(*tree, prev);
+        vmm_region_free(next);
+    } else if (merge_prev) {
+        *tree = range_tree_remove(*tree, prev->start);
+        prev->size += size;
+        *tree = range_tree_insert(*tree, prev);
+    } else if (merge_next) {
+        *tree = range_tree_remove(*tree, next->start);
+        next->start = vaddr;
+        next->size += size;
+        *tree = range_tree_insert(*tree, next);
+    } else {
+        vmm_region_t* node = vmm_region_alloc();
+        if (!node) {
+            panic("vmm_free: no region node for the freed range");
+        }
+        node->start = vaddr;
+        node->size = size;
+        *tree = range_tree_insert(*tree, node);
+    }
 }
 
 
@@ -304,10 +662,132 @@ void vmm_run_inline_tests() {
     vmm_free(ptr2, 4096, false);
     write_serial_string("Freed 1-page allocation.\n");
 
+    // Both frees merged back into the one initial range
+    if (range_tree_count(user_space_free_tree) != 1) panic("vmm_free did not coalesce neighbours");
+    write_serial_string("Freed ranges coalesced.\n");
+
     // Reallocate and verify reuse
     void* ptr3 = vmm_alloc(4096, false);
     if (!ptr3) panic("vmm_alloc failed after free");
+    if (ptr3 != ptr1) panic("vmm_alloc did not reuse the lowest free range");
     write_serial_string("Reallocated 1 page after free.\n");
 
+    // Aligned request leaves the padding free
+    void* ptr4 = vmm_alloc_aligned(PAGE_SIZE, 0x10000, false);
+    if (!ptr4 || ((uintptr_t)ptr4 & 0xFFFF)) panic("vmm_alloc_aligned returned unaligned address");
+    vmm_free(ptr4, PAGE_SIZE, false);
+    vmm_free(ptr3, 4096, false);
+    if (range_tree_count(user_space_free_tree) != 1) panic("Aligned padding did not coalesce");
+
+    // Lazy allocation costs no frames until touched
+    uint32_t free_before = pmm_get_free_page_count();
+    struct vmm_fault_stats before;
+    vmm_get_fault_stats(&before);
+
+    volatile uint32_t* lazy = (uint32_t*)vmm_alloc_lazy(64 * PAGE_SIZE, true);
+    if (!lazy) panic("vmm_alloc_lazy failed");
+    if (pmm_get_free_page_count() != free_before) panic("vmm_alloc_lazy backed pages up front");
+
+    lazy[0] = 1;
+    lazy[40 * PAGE_SIZE / 4] = 2;
+    if (lazy[0] != 1 || lazy[40 * PAGE_SIZE / 4] != 2 || lazy[PAGE_SIZE / 4] != 0) {
+        panic("Lazy pages hold the wrong data");
+    }
+
+    struct vmm_fault_stats after;
+    vmm_get_fault_stats(&after);
+    if (after.minor_faults - before.minor_faults != 3) panic("Lazy touches did not fault exactly once per page");
+
+    vmm_free((void*)lazy, 64 * PAGE_SIZE, true);
+    write_serial_string("Lazy allocation faulted in 3 pages.\n");
+
+    // The region cache grows past one slab and shrinks back. Every other
+    // page is freed so no range merges and each needs its own node.
+    struct slab_cache_stats cache_before, cache_after;
+    slab_get_stats(&region_cache, &cache_before);
+    uint32_t holes = cache_before.objects_per_slab + 8;
+    uint8_t* span = (uint8_t*)vmm_alloc_lazy(2 * holes * PAGE_SIZE, true);
+    if (!span) panic("vmm_alloc_lazy failed for the cache test");
+    for (uint32_t i = 0; i < holes; i++) {
+        vmm_free(span + 2 * i * PAGE_SIZE, PAGE_SIZE, true);
+    }
+    slab_get_stats(&region_cache, &cache_after);
+    if (cache_after.slabs <= cache_before.slabs) panic("Region cache did not grow");
+    for (uint32_t i = 0; i < 2 * holes; i++) {
+        if ((lazy_region_find((uintptr_t)span + i * PAGE_SIZE) != NULL) != (i & 1)) {
+            panic("Partial vmm_free left the lazy range out of step");
+        }
+    }
+
+    for (uint32_t i = 0; i < holes; i++) {
+        vmm_free(span + (2 * i + 1) * PAGE_SIZE, PAGE_SIZE, true);
+    }
+    slab_get_stats(&region_cache, &cache_after);
+    if (cache_after.objects_in_use > cache_before.objects_in_use + 1) panic("Region nodes leaked");
+    write_serial_string("Region cache grew and shrank.\n");
+
+    // Kernel stacks: writable end to end, guard page unmapped, and a freed
+    // stack comes straight back from the cache
+    uintptr_t top = vmm_alloc_kernel_stack();
+    if (!top) panic("vmm_alloc_kernel_stack failed");
+    volatile uint32_t* stack_word = (uint32_t*)(top - 4);
+    *stack_word = 0x57AC;
+    stack_word = (uint32_t*)(top - KSTACK_SIZE);
+    *stack_word = 0x57AC;
+
+    uintptr_t guard = top - KSTACK_SIZE - PAGE_SIZE;
+    uint32_t* pd = (uint32_t*)(RECURSIVE_BASE_VADDR + RECURSIVE_SLOT * PAGE_SIZE);
+    if ((pd[guard >> 22] & PAGE_PRESENT) &&
+        (((uint32_t*)RECURSIVE_BASE_VADDR)[guard >> 12] & PAGE_PRESENT)) {
+        panic("Kernel stack guard page is mapped");
+    }
+    if (!vmm_is_stack_guard(guard) || vmm_is_stack_guard(top - KSTACK_SIZE)) {
+        panic("vmm_is_stack_guard misreports the guard page");
+    }
+
+    struct vmm_kstack_stats ks_before, ks_after;
+    vmm_get_kstack_stats(&ks_before);
+    free_before = pmm_get_free_page_count();
+    vmm_free_kernel_stack(top);
+    if (vmm_alloc_kernel_stack() != top) panic("Freed kernel stack was not reused");
+    vmm_get_kstack_stats(&ks_after);
+    if (ks_after.cache_hits != ks_before.cache_hits + 1 || pmm_get_free_page_count() != free_before) {
+        panic("Kernel stack reuse went back to the page allocator");
+    }
+    vmm_free_kernel_stack(top);
+    write_serial_string("Kernel stack allocator passed.\n");
+
+    // Huge allocations: each whole 4 MB chunk is either one large page or a
+    // counted fallback to small frames, and the range reads back zeroed
+    struct vmm_huge_stats hs_before, hs_after;
+    vmm_get_huge_stats(&hs_before);
+    volatile uint32_t* huge = (uint32_t*)vmm_alloc_flags(2 * PAGE_LARGE_SIZE + PAGE_SIZE, false, VMM_ALLOC_HUGE);
+    if (!huge) panic("vmm_alloc_flags failed on a huge allocation");
+    if ((uintptr_t)huge & (PAGE_LARGE_SIZE - 1)) panic("Huge allocation is not 4 MB aligned");
+    vmm_get_huge_stats(&hs_after);
+    if ((hs_after.large_allocs - hs_before.large_allocs) + (hs_after.fallbacks - hs_before.fallbacks) != 2) {
+        panic("Huge allocation did not account for both 4 MB chunks");
+    }
+    if (huge[PAGE_LARGE_SIZE / 4 + 7] != 0 || huge[2 * PAGE_LARGE_SIZE / 4] != 0) {
+        panic("Huge allocation is not zeroed");
+    }
+    huge[PAGE_LARGE_SIZE / 4 + 7] = 0x4D4D;
+    vmm_free((void*)huge, 2 * PAGE_LARGE_SIZE + PAGE_SIZE, false);
+    vmm_get_huge_stats(&hs_after);
+    if (hs_after.large_pages_in_use != hs_before.large_pages_in_use) panic("Large pages leaked");
+    write_serial_string("Huge allocation passed, large pages: ");
+    serial_write_dec(hs_after.large_allocs - hs_before.large_allocs);
+    write_serial_string("\n");
+
+    // Freeing everything mapped through a page table gives the table back
+    uint32_t reclaimed_before = paging_reclaimed_tables();
+    uint8_t* lone = (uint8_t*)vmm_alloc_aligned(2 * PAGE_SIZE, PAGE_LARGE_SIZE, false);
+    if (!lone) panic("vmm_alloc_aligned failed for the page table test");
+    lone[PAGE_SIZE] = 1;
+    vmm_free(lone, 2 * PAGE_SIZE, false);
+    if (pd[(uintptr_t)lone >> 22] & PAGE_PRESENT) panic("Empty page table was not reclaimed");
+    if (paging_reclaimed_tables() <= reclaimed_before) panic("Page table reclaim was not counted");
+    write_serial_string("Empty page table reclaimed.\n");
+
     write_serial_string("VMM inline tests passed.\n");
 }
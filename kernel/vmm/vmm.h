@@ -10,15 +10,65 @@
 #define PAGE_PRESENT  0x1
 #define PAGE_WRITE    0x2
 #define PAGE_USER     0x4
-#define VMM_REGION_POOL_VADDR 0xC0000000   // example: kernel high half unused region
-#define VMM_REGION_POOL_PAGES 4 
+#define VMM_MAP_BATCH 64                  // frames gathered per paging_map_range_list call
 #include <stddef.h>
 #include <stdbool.h>
-#include "../stdint.h"                    // 4 pages => ~16KB slab
+#include "../stdint.h"
+
+// #PF error code bits
+#define PF_ERR_PRESENT 0x1
+#define PF_ERR_WRITE   0x2
+#define PF_ERR_USER    0x4
+
+struct vmm_fault_stats {
+    uint64_t minor_faults;       // faults resolved by backing a lazy page
+    uint64_t cow_faults;         // write faults resolved by breaking a COW share
+    uint64_t total_cycles;       // TSC cycles spent resolving both kinds
+    uint64_t max_cycles;
+};
+
+// vmm_alloc_flags bits, shared with the mmap syscall once it exists
+#define VMM_ALLOC_HUGE      0x1           // back whole 4 MB chunks with PSE pages
+#define VMM_ALLOC_LAZY      0x2           // reserve only, back on first touch
+#define VMM_ALLOC_RESERVE   0x4           // reserve only, the caller maps it
+
+#define PAGE_NOCACHE  0x18                // PWT | PCD, for device registers
+
+struct vmm_huge_stats {
+    uint32_t large_pages_in_use; // 4 MB pages currently mapped by the VMM
+    uint32_t large_allocs;       // 4 MB chunks backed by one contiguous block
+    uint32_t fallbacks;          // chunks that had to use 4 KB frames instead
+};
+
+// Kernel stacks: KSTACK_PAGES mapped above KSTACK_GUARD_PAGES left unmapped,
+// so running off the bottom faults instead of corrupting a neighbour
+#define KSTACK_PAGES        4
+#define KSTACK_GUARD_PAGES  1
+#define KSTACK_SIZE         (KSTACK_PAGES * PAGE_SIZE)
+#define KSTACK_CACHE_MAX    16            // freed stacks kept mapped for reuse
+
+struct vmm_kstack_stats {
+    uint32_t live;               // stacks currently handed out
+    uint32_t cached;             // freed stacks waiting for reuse
+    uint32_t allocs;
+    uint32_t cache_hits;         // allocations served without mapping
+};
 
 void vmm_init();
 void* vmm_alloc(uint32_t size, bool kernel);
+void* vmm_alloc_flags(uint32_t size, bool kernel, uint32_t vmm_flags);
+void* vmm_alloc_lazy(uint32_t size, bool kernel);
+void* vmm_alloc_aligned(uint32_t size, uint32_t align, bool kernel);
+int vmm_handle_page_fault(uintptr_t fault_addr, uint32_t error_code);
+void vmm_get_fault_stats(struct vmm_fault_stats* out);
+uintptr_t vmm_alloc_kernel_stack(void);
+void vmm_free_kernel_stack(uintptr_t top);
+bool vmm_is_stack_guard(uintptr_t addr);
+void vmm_get_kstack_stats(struct vmm_kstack_stats* out);
+void vmm_get_huge_stats(struct vmm_huge_stats* out);
 void vmm_free(void* addr, uint32_t size, bool kernel);
+void* vmm_map_phys(uintptr_t phys, uint32_t size, uint32_t page_flags);
+void vmm_unmap_phys(void* addr, uintptr_t phys, uint32_t size);
 void vmm_run_inline_tests();
 
 #endif
@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "../kernel/trace/trace_events.h"
+
+// Decode a serial capture holding trace batches from kernel/trace/trace.c.
+// Console text between batches is passed through unchanged.
+//
+//   cc -o tracedec tools/tracedec.c
+//   qemu-system-i386 ... -serial file:serial.log
+//   ./tracedec kernel.map serial.log [tsc_mhz]
+
+#define MAX_LINE 256
+#define MAX_SYMBOLS 8192
+
+struct symbol {
+    uint32_t addr;
+    char name[128];
+};
+
+struct event_info {
+    const char* name;
+    const char* args[4];
+};
+
+#define TRACE_EVENT_INFO(id, name, a0, a1, a2, a3) [id] = { #name, { a0, a1, a2, a3 } },
+static const struct event_info events[TRACE_EV_COUNT] = {
+    TRACE_EVENT_LIST(TRACE_EVENT_INFO)
+};
+
+static struct symbol symbols[MAX_SYMBOLS];
+static int symbol_count = 0;
+
+static int symbol_cmp(const void* a, const void* b) {
+    uint32_t x = ((const struct symbol*)a)->addr, y = ((const struct symbol*)b)->addr;
+    return x < y ? -1 : x > y;
+}
+
+static void load_map(const char* map_file) {
+    FILE* file = fopen(map_file, "r");
+    if (!file) {
+        perror("Failed to open map file");
+        exit(1);
+    }
+
+    char line[MAX_LINE];
+    while (fgets(line, sizeof(line), file) && symbol_count < MAX_SYMBOLS) {
+        unsigned long addr;
+        char name[128];
+        if (sscanf(line, " %lx %127s", &addr, name) != 2) continue;
+        if (name[0] == '.' || name[0] == '*' || strchr(line, '=')) continue;
+
+        symbols[symbol_count].addr = (uint32_t)addr;
+        snprintf(symbols[symbol_count].name, sizeof(symbols[0].name), "%s", name);
+        symbol_count++;
+    }
+    fclose(file);
+
+    qsort(symbols, symbol_count, sizeof(symbols[0]), symbol_cmp);
+}
+
+// Closest symbol at or below addr, NULL if addr is outside the map
+static const struct symbol* lookup(uint32_t addr, uint32_t max_offset) {
+    int lo = 0, hi = symbol_count - 1, best = -1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (symbols[mid].addr <= addr) {
+            best = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    if (best < 0 || addr - symbols[best].addr > max_offset) return NULL;
+    return &symbols[best];
+}
+
+static uint32_t rd16(const uint8_t* p) { return p[0] | p[1] << 8; }
+static uint32_t rd32(const uint8_t* p) { return rd16(p) | rd16(p + 2) << 16; }
+static uint64_t rd64(const uint8_t* p) { return rd32(p) | (uint64_t)rd32(p + 4) << 32; }
+
+static uint64_t first_tsc = 0;
+
+static void print_record(const uint8_t* r, double tsc_mhz) {
+    uint64_t tsc = rd64(r);
+    uint32_t event = rd16(r + 8);
+    uint32_t cpu = r[10];
+    uint32_t nargs = r[11];
+    uint32_t site = rd32(r + 12);
+
+    if (!first_tsc) first_tsc = tsc;
+    if (tsc_mhz > 0) {
+        printf("[%12.3f us] cpu%u ", (tsc - first_tsc) / tsc_mhz, cpu);
+    } else {
+        printf("[%14llu] cpu%u ", (unsigned long long)(tsc - first_tsc), cpu);
+    }
+
+    if (event == 0xFFFF) {
+        printf("<record lost while draining>\n");
+        return;
+    }
+
+    const struct event_info* info = event < TRACE_EV_COUNT ? &events[event] : NULL;
+    if (info) {
+        printf("%-10s", info->name);
+    } else {
+        printf("event%-5u", event);
+    }
+
+    for (uint32_t i = 0; i < nargs && i < 4; i++) {
+        uint32_t v = rd32(r + 16 + i * 4);
+        const char* label = info && info->args[i][0] ? info->args[i] : "arg";
+        printf(" %s=0x%08x", label, v);
+
+        const struct symbol* s = lookup(v, 0x1000);
+        if (s) printf("<%s+0x%x>", s->name, v - s->addr);
+    }
+
+    const struct symbol* s = lookup(site, 0x10000);
+    if (s) {
+        printf("  @ %s+0x%x\n", s->name, site - s->addr);
+    } else {
+        printf("  @ 0x%08x\n", site);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 3 && argc != 4) {
+        printf("Usage: %s kernel.map capture [tsc_mhz]\n", argv[0]);
+        return 1;
+    }
+
+    load_map(argv[1]);
+    double tsc_mhz = argc == 4 ? atof(argv[3]) : 0;
+
+    FILE* file = fopen(argv[2], "rb");
+    if (!file) {
+        perror("Failed to open capture");
+        return 1;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    uint8_t* data = malloc(size > 0 ? size : 1);
+    if (!data || fread(data, 1, size, file) != (size_t)size) {
+        perror("Failed to read capture");
+        return 1;
+    }
+    fclose(file);
+
+    long pos = 0;
+    while (pos < size) {
+        if (size - pos >= TRACE_FRAME_MAGIC_LEN + 4 &&
+            !memcmp(data + pos, TRACE_FRAME_MAGIC, TRACE_FRAME_MAGIC_LEN)) {
+            uint32_t count = rd16(data + pos + TRACE_FRAME_MAGIC_LEN);
+            uint32_t dropped = rd16(data + pos + TRACE_FRAME_MAGIC_LEN + 2);
+            pos += TRACE_FRAME_MAGIC_LEN + 4;
+
+            if (dropped) printf("--- %u trace records lost to overwrite ---\n", dropped);
+            for (uint32_t i = 0; i < count; i++) {
+                if (size - pos < TRACE_RECORD_SIZE) {
+                    printf("--- capture ends inside a trace batch ---\n");
+                    pos = size;
+                    break;
+                }
+                print_record(data + pos, tsc_mhz);
+                pos += TRACE_RECORD_SIZE;
+            }
+            continue;
+        }
+
+        putchar(data[pos++]);
+    }
+
+    free(data);
+    return 0;
+}